@@ -0,0 +1,498 @@
+/*
+ * This file is part of signon-ui
+ *
+ * Copyright (C) 2014 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "browser-network-access-manager.h"
+
+#include "cookie-jar-manager.h"
+#include "debug.h"
+#include "network-cache.h"
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QNetworkReply>
+#include <QNetworkRequest>
+#include <QRegExp>
+#include <QSet>
+
+using namespace SignOnUi;
+
+namespace SignOnUi {
+
+/* A reply which never touches the network: it just fails with
+ * ContentAccessDenied as soon as the event loop is reentered. */
+class BlockedReply: public QNetworkReply
+{
+    Q_OBJECT
+
+public:
+    BlockedReply(QNetworkAccessManager::Operation op,
+                 const QNetworkRequest &request,
+                 QObject *parent = 0):
+        QNetworkReply(parent)
+    {
+        setRequest(request);
+        setUrl(request.url());
+        setOperation(op);
+        setError(ContentAccessDenied,
+                 QStringLiteral("Blocked by signon-ui"));
+        open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+        QMetaObject::invokeMethod(this, "finish", Qt::QueuedConnection);
+    }
+    ~BlockedReply() {}
+
+    // reimplemented virtual methods
+    void abort() {}
+    qint64 bytesAvailable() const { return 0; }
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) {
+        Q_UNUSED(data);
+        Q_UNUSED(maxSize);
+        return -1;
+    }
+
+private Q_SLOTS:
+    void finish() {
+        setFinished(true);
+        Q_EMIT error(ContentAccessDenied);
+        Q_EMIT finished();
+    }
+};
+
+class BrowserNetworkAccessManagerPrivate: public QObject
+{
+    Q_OBJECT
+    Q_DECLARE_PUBLIC(BrowserNetworkAccessManager)
+
+public:
+    BrowserNetworkAccessManagerPrivate(BrowserNetworkAccessManager *q);
+    ~BrowserNetworkAccessManagerPrivate() {}
+
+    void watchReply(QNetworkReply *reply, bool isNavigation);
+    void reset();
+
+private Q_SLOTS:
+    void onFinalUrlReached(const QUrl &url);
+    void onMetaDataChanged();
+    void onDownloadProgress(qint64 bytesReceived, qint64 bytesTotal);
+    void onReplyFinished();
+    void onReplyDestroyed(QObject *object);
+    void onEncrypted(QNetworkReply *reply);
+
+private:
+    mutable BrowserNetworkAccessManager *q_ptr;
+    /* Replies which reached the network */
+    QSet<QObject*> m_replies;
+    QHash<QObject*,QElapsedTimer> m_replyTimers;
+    QHash<QObject*,BrowserNetworkAccessManager::Timing> m_timings;
+    NetworkCache *m_cache;
+    QRegExp m_blockedResources;
+    QRegExp m_allowedResources;
+    QUrl m_finalUrl;
+    bool m_finalUrlReached;
+    /* Navigations announced, whose request has not been made yet */
+    QList<QUrl> m_expectedNavigations;
+    BrowserNetworkAccessManager::Statistics m_statistics;
+    /* Whether this is the long-lived manager of its identity */
+    bool m_isShared;
+    bool m_inUse;
+};
+
+} // namespace
+
+/* The long-lived managers, per identity */
+static QHash<uint,BrowserNetworkAccessManager*> identityManagers;
+
+static const char receivedBytesProperty[] = "signon-ui-received-bytes";
+static const char navigationProperty[] = "signon-ui-navigation";
+/* Navigations which never turned into a request are forgotten */
+static const int maxExpectedNavigations = 8;
+
+/* The fragment is not part of the network request */
+static QUrl withoutFragment(const QUrl &url)
+{
+    QUrl copy(url);
+    copy.setFragment(QString());
+    return copy;
+}
+
+BrowserNetworkAccessManagerPrivate::BrowserNetworkAccessManagerPrivate(
+    BrowserNetworkAccessManager *q):
+    QObject(q),
+    q_ptr(q),
+    m_cache(0),
+    m_finalUrlReached(false),
+    m_isShared(false),
+    m_inUse(false)
+{
+    QObject::connect(q, SIGNAL(encrypted(QNetworkReply*)),
+                     this, SLOT(onEncrypted(QNetworkReply*)));
+}
+
+void BrowserNetworkAccessManagerPrivate::watchReply(QNetworkReply *reply,
+                                                    bool isNavigation)
+{
+    if (isNavigation) {
+        reply->setProperty(navigationProperty, true);
+    }
+    m_replies.insert(reply);
+    m_replyTimers[reply].start();
+    QObject::connect(reply, SIGNAL(destroyed(QObject*)),
+                     this, SLOT(onReplyDestroyed(QObject*)));
+    QObject::connect(reply, SIGNAL(metaDataChanged()),
+                     this, SLOT(onMetaDataChanged()));
+    QObject::connect(reply, SIGNAL(downloadProgress(qint64,qint64)),
+                     this, SLOT(onDownloadProgress(qint64,qint64)));
+    QObject::connect(reply, SIGNAL(finished()),
+                     this, SLOT(onReplyFinished()));
+}
+
+/* Forget everything about the page which used the manager */
+void BrowserNetworkAccessManagerPrivate::reset()
+{
+    m_blockedResources = QRegExp();
+    m_allowedResources = QRegExp();
+    m_finalUrl = QUrl();
+    m_finalUrlReached = false;
+    m_expectedNavigations.clear();
+    m_statistics = BrowserNetworkAccessManager::Statistics();
+}
+
+void BrowserNetworkAccessManagerPrivate::onFinalUrlReached(const QUrl &url)
+{
+    Q_Q(BrowserNetworkAccessManager);
+
+    if (m_finalUrlReached) return;
+    m_finalUrlReached = true;
+
+    TRACE() << "Final URL reached:" << url;
+    Q_EMIT q->finalUrlReached(url);
+
+    /* Nothing else on the page is of any interest now */
+    foreach (QObject *object, m_replies) {
+        QNetworkReply *reply = qobject_cast<QNetworkReply*>(object);
+        if (reply != 0 && !reply->isFinished()) {
+            reply->abort();
+        }
+    }
+}
+
+void BrowserNetworkAccessManagerPrivate::onMetaDataChanged()
+{
+    Q_Q(BrowserNetworkAccessManager);
+
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    if (reply == 0) return;
+
+    BrowserNetworkAccessManager::Timing &timing = m_timings[reply];
+    if (timing.firstByteTime < 0) {
+        timing.firstByteTime = m_replyTimers[reply].elapsed();
+    }
+
+    /* The reply is stored in the cache when its first data arrives, that is
+     * after this signal */
+    if (reply->request().hasRawHeader("Cookie") ||
+        reply->request().hasRawHeader("Authorization") ||
+        reply->hasRawHeader("Set-Cookie")) {
+        m_cache->setExcluded(reply->url(), true);
+    }
+
+    /* Only redirections of the page itself can lead to the final URL */
+    if (!reply->property(navigationProperty).toBool()) return;
+
+    int status =
+        reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    if (status < 300 || status >= 400) return;
+
+    QUrl target =
+        reply->attribute(QNetworkRequest::RedirectionTargetAttribute).toUrl();
+    if (target.isEmpty()) return;
+
+    target = reply->url().resolved(target);
+    if (q->isFinalUrl(target)) {
+        /* This slot is invoked before QtWebKit gets to see the reply, so the
+         * redirection will not be followed. */
+        onFinalUrlReached(target);
+    } else {
+        /* QtWebKit will follow the redirection */
+        q->expectNavigation(target);
+    }
+}
+
+void BrowserNetworkAccessManagerPrivate::onDownloadProgress(qint64 bytesReceived,
+                                                            qint64 bytesTotal)
+{
+    Q_UNUSED(bytesTotal);
+    sender()->setProperty(receivedBytesProperty, bytesReceived);
+}
+
+void BrowserNetworkAccessManagerPrivate::onReplyFinished()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    if (reply == 0) return;
+
+    /* In case the reply had no body */
+    m_cache->setExcluded(reply->url(), false);
+
+    BrowserNetworkAccessManager::Timing &timing = m_timings[reply];
+    timing.finishedTime = m_replyTimers[reply].elapsed();
+    timing.fromCache =
+        reply->attribute(QNetworkRequest::SourceIsFromCacheAttribute).toBool();
+
+    qint64 bytes = reply->property(receivedBytesProperty).toLongLong();
+    if (timing.fromCache) {
+        m_statistics.cacheBytes += bytes;
+    } else {
+        m_statistics.networkBytes += bytes;
+    }
+}
+
+void BrowserNetworkAccessManagerPrivate::onReplyDestroyed(QObject *object)
+{
+    m_replies.remove(object);
+    m_replyTimers.remove(object);
+    m_timings.remove(object);
+}
+
+void BrowserNetworkAccessManagerPrivate::onEncrypted(QNetworkReply *reply)
+{
+    if (!m_replies.contains(reply)) return;
+    m_timings[reply].encryptedTime = m_replyTimers[reply].elapsed();
+}
+
+/* Each identity has a long-lived instance of this class, which holds its
+ * cookie jar and is lent to one browser page at a time, so that the
+ * connections and TLS sessions survive from one authentication to the next.
+ * Static assets (CSS, scripts, images) of
+ * the login pages are stored in a disk cache shared by all the browser
+ * requests, unless they were requested with credentials or set cookies; the
+ * proxy settings are application wide.
+ *
+ * The browser pages also load plenty of resources which are useless for the
+ * authentication (analytics, tracking scripts, web fonts...); this class lets
+ * the webkit-options.d files block them, so that they don't delay the
+ * loadFinished() signal.
+ *
+ * Authentication flows usually end with a redirection to the final URL: this
+ * class detects it on the HTTP response itself, and aborts all the pending
+ * loads instead of waiting for QtWebKit to follow the redirection.
+ */
+BrowserNetworkAccessManager::BrowserNetworkAccessManager(QObject *parent):
+    NetworkAccessManager(parent),
+    d_ptr(new BrowserNetworkAccessManagerPrivate(this))
+{
+    Q_D(BrowserNetworkAccessManager);
+    d->m_cache = new NetworkCache(this);
+    setCache(d->m_cache);
+}
+
+BrowserNetworkAccessManager::~BrowserNetworkAccessManager()
+{
+}
+
+static BrowserNetworkAccessManager *newManagerForIdentity(uint identity)
+{
+    BrowserNetworkAccessManager *manager = new BrowserNetworkAccessManager;
+    CookieJarManager *cookieJarManager = CookieJarManager::instance();
+    CookieJar *cookieJar = cookieJarManager->cookieJarForIdentity(identity);
+    manager->setCookieJar(cookieJar);
+    /* QNetworkAccessManager takes ownership of the cookieJar; we don't want
+     * this */
+    cookieJar->setParent(cookieJarManager);
+    return manager;
+}
+
+BrowserNetworkAccessManager *BrowserNetworkAccessManager::forIdentity(uint identity)
+{
+    BrowserNetworkAccessManager *manager = identityManagers.value(identity, 0);
+    if (manager == 0) {
+        manager = newManagerForIdentity(identity);
+        manager->d_ptr->m_isShared = true;
+        identityManagers.insert(identity, manager);
+    }
+    return manager;
+}
+
+BrowserNetworkAccessManager *BrowserNetworkAccessManager::acquire(uint identity)
+{
+    BrowserNetworkAccessManager *manager = forIdentity(identity);
+    if (manager->d_ptr->m_inUse) {
+        TRACE() << "Manager of identity" << identity << "busy, creating one";
+        manager = newManagerForIdentity(identity);
+    }
+    manager->d_ptr->m_inUse = true;
+    return manager;
+}
+
+void BrowserNetworkAccessManager::release(BrowserNetworkAccessManager *manager)
+{
+    if (manager == 0) return;
+
+    if (!manager->d_ptr->m_isShared) {
+        manager->deleteLater();
+        return;
+    }
+
+    /* Nothing of the previous page must leak into the next one */
+    QObject::disconnect(manager, SIGNAL(finalUrlReached(const QUrl&)), 0, 0);
+    manager->d_ptr->reset();
+    manager->d_ptr->m_inUse = false;
+}
+
+void BrowserNetworkAccessManager::removeForIdentity(uint identity)
+{
+    BrowserNetworkAccessManager *manager = identityManagers.take(identity);
+    if (manager == 0) return;
+
+    /* A manager in use will be deleted when released */
+    manager->d_ptr->m_isShared = false;
+    if (!manager->d_ptr->m_inUse) {
+        manager->deleteLater();
+    }
+}
+
+void BrowserNetworkAccessManager::setBlockedResourcesPattern(const QString &pattern)
+{
+    Q_D(BrowserNetworkAccessManager);
+    d->m_blockedResources =
+        QRegExp(pattern, Qt::CaseInsensitive, QRegExp::RegExp2);
+}
+
+void BrowserNetworkAccessManager::setAllowedResourcesPattern(const QString &pattern)
+{
+    Q_D(BrowserNetworkAccessManager);
+    d->m_allowedResources =
+        QRegExp(pattern, Qt::CaseInsensitive, QRegExp::RegExp2);
+}
+
+bool BrowserNetworkAccessManager::isBlocked(const QUrl &url) const
+{
+    Q_D(const BrowserNetworkAccessManager);
+
+    if (d->m_blockedResources.isEmpty()) return false;
+
+    /* Patterns are matched against the URL without scheme, as it's done for
+     * the InternalLinksPattern and ExternalLinksPattern keys. */
+    QString urlText = url.toString(QUrl::RemoveScheme |
+                                   QUrl::RemoveUserInfo |
+                                   QUrl::RemoveFragment |
+                                   QUrl::StripTrailingSlash);
+    if (urlText.startsWith("//")) {
+        urlText = urlText.mid(2);
+    }
+
+    if (!d->m_allowedResources.isEmpty() &&
+        d->m_allowedResources.exactMatch(urlText)) {
+        return false;
+    }
+
+    return d->m_blockedResources.exactMatch(urlText);
+}
+
+void BrowserNetworkAccessManager::setFinalUrl(const QUrl &url)
+{
+    Q_D(BrowserNetworkAccessManager);
+    d->m_finalUrl = url;
+    d->m_finalUrlReached = false;
+}
+
+bool BrowserNetworkAccessManager::matchesFinalUrl(const QUrl &url,
+                                                  const QUrl &finalUrl)
+{
+    if (finalUrl.isEmpty()) return false;
+
+    static QRegExp trailingSlashes("/*$");
+    QString path = url.path();
+    QString finalPath = finalUrl.path();
+    return url.scheme() == finalUrl.scheme() &&
+        url.host() == finalUrl.host() &&
+        url.port() == finalUrl.port() &&
+        path.remove(trailingSlashes) == finalPath.remove(trailingSlashes);
+}
+
+bool BrowserNetworkAccessManager::isFinalUrl(const QUrl &url) const
+{
+    Q_D(const BrowserNetworkAccessManager);
+    return matchesFinalUrl(url, d->m_finalUrl);
+}
+
+void BrowserNetworkAccessManager::expectNavigation(const QUrl &url)
+{
+    Q_D(BrowserNetworkAccessManager);
+
+    d->m_expectedNavigations.append(withoutFragment(url));
+    if (d->m_expectedNavigations.count() > maxExpectedNavigations) {
+        d->m_expectedNavigations.removeFirst();
+    }
+}
+
+BrowserNetworkAccessManager::Statistics
+BrowserNetworkAccessManager::statistics() const
+{
+    Q_D(const BrowserNetworkAccessManager);
+    return d->m_statistics;
+}
+
+BrowserNetworkAccessManager::Timing
+BrowserNetworkAccessManager::timing(QNetworkReply *reply) const
+{
+    Q_D(const BrowserNetworkAccessManager);
+    return d->m_timings.value(reply);
+}
+
+QNetworkReply *
+BrowserNetworkAccessManager::createRequest(Operation op,
+                                           const QNetworkRequest &request,
+                                           QIODevice *outgoingData)
+{
+    Q_D(BrowserNetworkAccessManager);
+
+    bool isNavigation =
+        d->m_expectedNavigations.removeOne(withoutFragment(request.url()));
+    if (isNavigation && isFinalUrl(request.url())) {
+        /* We are not going to load the final URL anyway; do not let it reach
+         * the network, and notify it once we are out of QtWebKit's call. */
+        QMetaObject::invokeMethod(d, "onFinalUrlReached", Qt::QueuedConnection,
+                                  Q_ARG(QUrl, request.url()));
+        return new BlockedReply(op, request, this);
+    }
+
+    if (!isBlocked(request.url())) {
+        QNetworkReply *reply =
+            NetworkAccessManager::createRequest(op, request, outgoingData);
+        d->watchReply(reply, isNavigation);
+        return reply;
+    }
+
+    TRACE() << "Blocked:" << request.url();
+    d->m_statistics.blockedRequests++;
+    QVariant contentLength =
+        request.header(QNetworkRequest::ContentLengthHeader);
+    if (contentLength.isValid()) {
+        d->m_statistics.blockedBytes += contentLength.toLongLong();
+    } else if (outgoingData != 0) {
+        d->m_statistics.blockedBytes += outgoingData->size();
+    }
+
+    return new BlockedReply(op, request, this);
+}
+
+#include "browser-network-access-manager.moc"
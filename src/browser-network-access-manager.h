@@ -0,0 +1,112 @@
+/*
+ * This file is part of signon-ui
+ *
+ * Copyright (C) 2014 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIGNON_UI_BROWSER_NETWORK_ACCESS_MANAGER_H
+#define SIGNON_UI_BROWSER_NETWORK_ACCESS_MANAGER_H
+
+#include "network-access-manager.h"
+
+#include <QObject>
+#include <QString>
+#include <QUrl>
+
+namespace SignOnUi {
+
+class BrowserNetworkAccessManagerPrivate;
+
+class BrowserNetworkAccessManager: public NetworkAccessManager
+{
+    Q_OBJECT
+
+public:
+    struct Statistics {
+        Statistics(): blockedRequests(0), blockedBytes(0),
+            networkBytes(0), cacheBytes(0) {}
+        int blockedRequests;
+        /* Size of the request bodies which were not sent */
+        qint64 blockedBytes;
+        /* Size of the replies, split by origin */
+        qint64 networkBytes;
+        qint64 cacheBytes;
+    };
+
+    /* Timings of a reply, in milliseconds since the request was sent; -1
+     * when not available. QNetworkAccessManager doesn't report the DNS and
+     * TCP connection times separately: they are part of encryptedTime (for
+     * new TLS connections) and of firstByteTime. */
+    struct Timing {
+        Timing(): encryptedTime(-1), firstByteTime(-1), finishedTime(-1),
+            fromCache(false) {}
+        qint64 encryptedTime;
+        qint64 firstByteTime;
+        qint64 finishedTime;
+        bool fromCache;
+    };
+
+    explicit BrowserNetworkAccessManager(QObject *parent = 0);
+    ~BrowserNetworkAccessManager();
+
+    /* The long-lived manager of an identity, holding its cookie jar: going
+     * through it lets consecutive authentications reuse the connections and
+     * TLS sessions. */
+    static BrowserNetworkAccessManager *forIdentity(uint identity);
+    /* Reserves the identity's manager for a browser page; if another page is
+     * using it, a new manager is created for the identity. The manager is not
+     * owned by the caller, and must be given back with release(). */
+    static BrowserNetworkAccessManager *acquire(uint identity);
+    static void release(BrowserNetworkAccessManager *manager);
+    /* Drops the identity's manager, along with its connections */
+    static void removeForIdentity(uint identity);
+
+    void setBlockedResourcesPattern(const QString &pattern);
+    void setAllowedResourcesPattern(const QString &pattern);
+    bool isBlocked(const QUrl &url) const;
+
+    /* Whether the URL points to the same resource as the final URL, ignoring
+     * the query, the fragment and any trailing slashes */
+    static bool matchesFinalUrl(const QUrl &url, const QUrl &finalUrl);
+
+    void setFinalUrl(const QUrl &url);
+    bool isFinalUrl(const QUrl &url) const;
+    /* The final URL is only looked for in the main frame navigations, which
+     * must be announced before the request is made */
+    void expectNavigation(const QUrl &url);
+
+    Statistics statistics() const;
+    /* Only available until the reply is destroyed */
+    Timing timing(QNetworkReply *reply) const;
+
+Q_SIGNALS:
+    void finalUrlReached(const QUrl &url);
+
+protected:
+    // reimplemented virtual methods
+    QNetworkReply *createRequest(Operation op,
+                                 const QNetworkRequest &request,
+                                 QIODevice *outgoingData = 0);
+
+private:
+    BrowserNetworkAccessManagerPrivate *d_ptr;
+    Q_DECLARE_PRIVATE(BrowserNetworkAccessManager)
+};
+
+} // namespace
+
+#endif // SIGNON_UI_BROWSER_NETWORK_ACCESS_MANAGER_H
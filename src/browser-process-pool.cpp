@@ -0,0 +1,466 @@
+/*
+ * This file is part of signon-ui
+ *
+ * Copyright (C) 2014 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "browser-process-pool.h"
+
+#include "debug.h"
+#include "process-memory.h"
+#include "remote-request-interface.h"
+#include "unix-socket-channel.h"
+
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QList>
+#include <QProcess>
+#include <QProcessEnvironment>
+#include <QTimer>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace SignOnUi;
+
+#ifndef BROWSER_PROCESS_PATH
+#define BROWSER_PROCESS_PATH "/usr/libexec/signon-ui/browser-process"
+#endif
+
+/* Processes which never served a request, kept ready for new requests */
+static const int spareWorkers = 1;
+/* Processes which can be reused by the identity they last served */
+static const int maxIdleWorkers = 3;
+/* Requests of the same identity which a process can serve at once */
+static const int maxConcurrentRequests = 4;
+/* A process is replaced after serving this many requests, or when its
+ * resident memory (in kB) grows above this limit */
+static const int maxRequestsPerWorker = 20;
+static const qint64 maxWorkerMemory = 200 * 1024;
+/* How long a process has to exit once its socket is closed */
+static const int workerQuitTimeout = 5000;
+/* A process exiting sooner than this after being started counts as a
+ * failure: new processes are started with an increasing delay, and the
+ * pool gives up after too many failures in a row */
+static const int minWorkerLifetime = 10000;
+static const int maxSpawnFailures = 5;
+static const int initialRespawnDelay = 1000;
+static const int maxRespawnDelay = 60000;
+
+static BrowserProcessPool *m_instance = 0;
+
+namespace SignOnUi {
+
+struct BrowserWorker
+{
+    BrowserWorker():
+        process(0), socket(0), client(0),
+        used(false), retiring(false), identity(0), requestCount(0),
+        users(0), reportedMemory(0) {}
+    QProcess *process;
+    UnixSocketChannel *socket;
+    RemoteRequestClient *client;
+    bool used;
+    bool retiring;
+    uint identity;
+    int requestCount;
+    /* Requests which have taken the client and not released it yet */
+    int users;
+    /* As last reported by the process, in kB */
+    qint64 reportedMemory;
+    QElapsedTimer startTime;
+};
+
+class BrowserProcessPoolPrivate: public QObject
+{
+    Q_OBJECT
+    Q_DECLARE_PUBLIC(BrowserProcessPool)
+
+public:
+    BrowserProcessPoolPrivate(BrowserProcessPool *pool);
+    ~BrowserProcessPoolPrivate();
+
+    BrowserWorker *spawnWorker();
+    BrowserWorker *takeWorker(uint identity);
+    BrowserWorker *workerForClient(QObject *client) const;
+    BrowserWorker *workerForProcess(QObject *process) const;
+    void makeIdle(BrowserWorker *worker);
+    void retireWorker(BrowserWorker *worker);
+    void removeWorker(BrowserWorker *worker);
+    void scheduleSpareWorkers();
+
+private Q_SLOTS:
+    void ensureSpareWorkers();
+    void onRequestCompleted();
+    void onMemoryUsage(qint64 residentSize);
+    void onProcessError(QProcess::ProcessError error);
+    void onProcessFinished();
+
+private:
+    /* Set when the browser process cannot be started at all */
+    bool m_disabled;
+    int m_spawnFailures;
+    QTimer m_respawnTimer;
+    QList<BrowserWorker*> m_workers;
+    /* Least recently used first */
+    QList<BrowserWorker*> m_idleWorkers;
+    mutable BrowserProcessPool *q_ptr;
+};
+
+} // namespace
+
+BrowserProcessPoolPrivate::BrowserProcessPoolPrivate(BrowserProcessPool *pool):
+    QObject(pool),
+    m_disabled(false),
+    m_spawnFailures(0),
+    q_ptr(pool)
+{
+    m_respawnTimer.setSingleShot(true);
+    QObject::connect(&m_respawnTimer, SIGNAL(timeout()),
+                     this, SLOT(ensureSpareWorkers()));
+
+    if (!QFileInfo(QStringLiteral(BROWSER_PROCESS_PATH)).isExecutable()) {
+        BLAME() << "Browser process not found:" << BROWSER_PROCESS_PATH;
+        m_disabled = true;
+        return;
+    }
+
+    /* Have a process ready by the time the first request is started */
+    scheduleSpareWorkers();
+}
+
+BrowserProcessPoolPrivate::~BrowserProcessPoolPrivate()
+{
+    /* The processes exit as soon as their socket is closed */
+    foreach (BrowserWorker *worker, m_workers) {
+        worker->socket->close();
+    }
+    qDeleteAll(m_workers);
+}
+
+BrowserWorker *BrowserProcessPoolPrivate::spawnWorker()
+{
+    if (m_disabled) return 0;
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+        BLAME() << "Couldn't create socket pair";
+        return 0;
+    }
+    /* The child's end must survive the exec(); since QProcess forks while
+     * in start(), no other process can inherit it. */
+    fcntl(fds[1], F_SETFD, 0);
+
+    BrowserWorker *worker = new BrowserWorker;
+    worker->process = new QProcess(this);
+    QProcessEnvironment environment =
+        QProcessEnvironment::systemEnvironment();
+    environment.insert("SSOUI_IPC_FD", QString::number(fds[1]));
+    worker->process->setProcessEnvironment(environment);
+    worker->process->setProcessChannelMode(QProcess::ForwardedChannels);
+    QObject::connect(worker->process,
+                     SIGNAL(finished(int,QProcess::ExitStatus)),
+                     this, SLOT(onProcessFinished()));
+    QObject::connect(worker->process, SIGNAL(error(QProcess::ProcessError)),
+                     this, SLOT(onProcessError(QProcess::ProcessError)));
+    worker->startTime.start();
+    worker->process->start(QStringLiteral(BROWSER_PROCESS_PATH));
+    close(fds[1]);
+
+    worker->socket = new UnixSocketChannel(this);
+    worker->socket->setSocketDescriptor(fds[0]);
+    worker->client = new RemoteRequestClient(this);
+    worker->client->setChannels(worker->socket, worker->socket);
+    QObject::connect(worker->client, SIGNAL(memoryUsage(qint64)),
+                     this, SLOT(onMemoryUsage(qint64)));
+
+    TRACE() << "Started browser process" << worker->process->processId();
+    m_workers.append(worker);
+    return worker;
+}
+
+BrowserWorker *BrowserProcessPoolPrivate::takeWorker(uint identity)
+{
+    /* Processes are only shared by requests of the same identity, so that
+     * nothing from other accounts is left in their web engine. */
+    foreach (BrowserWorker *worker, m_workers) {
+        if (worker->used && worker->identity == identity &&
+            worker->users > 0 && worker->users < maxConcurrentRequests &&
+            worker->requestCount < maxRequestsPerWorker &&
+            !worker->retiring) {
+            return worker;
+        }
+    }
+
+    for (int i = m_idleWorkers.count() - 1; i >= 0; i--) {
+        BrowserWorker *worker = m_idleWorkers[i];
+        if (worker->used && worker->identity == identity) {
+            return m_idleWorkers.takeAt(i);
+        }
+    }
+
+    for (int i = 0; i < m_idleWorkers.count(); i++) {
+        if (!m_idleWorkers[i]->used) {
+            return m_idleWorkers.takeAt(i);
+        }
+    }
+
+    return 0;
+}
+
+BrowserWorker *BrowserProcessPoolPrivate::workerForClient(QObject *client) const
+{
+    foreach (BrowserWorker *worker, m_workers) {
+        if (worker->client == client) return worker;
+    }
+    return 0;
+}
+
+BrowserWorker *BrowserProcessPoolPrivate::workerForProcess(QObject *process) const
+{
+    foreach (BrowserWorker *worker, m_workers) {
+        if (worker->process == process) return worker;
+    }
+    return 0;
+}
+
+void BrowserProcessPoolPrivate::makeIdle(BrowserWorker *worker)
+{
+    /* Wait for the replies to the canceled requests */
+    if (worker->client->pendingRequests() > 0) {
+        QObject::connect(worker->client, SIGNAL(result(int,const QVariantMap&)),
+                         this, SLOT(onRequestCompleted()),
+                         Qt::UniqueConnection);
+        QObject::connect(worker->client, SIGNAL(canceled(int)),
+                         this, SLOT(onRequestCompleted()),
+                         Qt::UniqueConnection);
+        return;
+    }
+    QObject::disconnect(worker->client, 0, this, SLOT(onRequestCompleted()));
+
+    qint64 memory = qMax(residentSetSize(worker->process->processId()),
+                         worker->reportedMemory);
+    if (worker->requestCount >= maxRequestsPerWorker ||
+        memory > maxWorkerMemory) {
+        TRACE() << "Recycling browser process" <<
+            worker->process->processId() << "after" <<
+            worker->requestCount << "requests, RSS" << memory << "kB";
+        retireWorker(worker);
+        return;
+    }
+
+    m_idleWorkers.append(worker);
+
+    /* Drop the least recently used processes, but not the spare ones */
+    int usedWorkers = 0;
+    foreach (BrowserWorker *idle, m_idleWorkers) {
+        if (idle->used) usedWorkers++;
+    }
+    for (int i = 0; usedWorkers > maxIdleWorkers; i++) {
+        BrowserWorker *idle = m_idleWorkers[i];
+        if (!idle->used) continue;
+        retireWorker(idle);
+        usedWorkers--;
+        i--;
+    }
+}
+
+void BrowserProcessPoolPrivate::retireWorker(BrowserWorker *worker)
+{
+    m_idleWorkers.removeOne(worker);
+    worker->retiring = true;
+    /* This makes the process exit; we clean up when it does */
+    worker->socket->close();
+    QTimer::singleShot(workerQuitTimeout, worker->process, SLOT(kill()));
+}
+
+void BrowserProcessPoolPrivate::removeWorker(BrowserWorker *worker)
+{
+    Q_Q(BrowserProcessPool);
+
+    m_workers.removeOne(worker);
+    bool wasIdle = m_idleWorkers.removeOne(worker);
+    if (!wasIdle && !worker->retiring) {
+        /* A request might be waiting for this process */
+        Q_EMIT q->clientLost(worker->client);
+    }
+
+    worker->client->deleteLater();
+    worker->socket->deleteLater();
+    worker->process->deleteLater();
+    delete worker;
+}
+
+void BrowserProcessPoolPrivate::scheduleSpareWorkers()
+{
+    if (m_disabled || m_respawnTimer.isActive()) return;
+
+    int delay = 0;
+    if (m_spawnFailures > 0) {
+        delay = qMin(initialRespawnDelay << (m_spawnFailures - 1),
+                     maxRespawnDelay);
+        TRACE() << "Starting a new browser process in" << delay << "ms";
+    }
+    m_respawnTimer.start(delay);
+}
+
+void BrowserProcessPoolPrivate::ensureSpareWorkers()
+{
+    if (m_disabled) return;
+
+    int spare = 0;
+    foreach (BrowserWorker *worker, m_idleWorkers) {
+        if (!worker->used) spare++;
+    }
+
+    for (; spare < spareWorkers; spare++) {
+        BrowserWorker *worker = spawnWorker();
+        if (worker == 0) break;
+        m_idleWorkers.append(worker);
+    }
+}
+
+void BrowserProcessPoolPrivate::onRequestCompleted()
+{
+    BrowserWorker *worker = workerForClient(sender());
+    if (worker == 0 || worker->users > 0) return;
+
+    makeIdle(worker);
+}
+
+void BrowserProcessPoolPrivate::onMemoryUsage(qint64 residentSize)
+{
+    BrowserWorker *worker = workerForClient(sender());
+    if (worker == 0) return;
+
+    worker->reportedMemory = residentSize;
+    /* Idle processes report their memory once their pages are gone */
+    if (residentSize > maxWorkerMemory &&
+        m_idleWorkers.contains(worker)) {
+        TRACE() << "Recycling idle browser process" <<
+            worker->process->processId() << "RSS" << residentSize << "kB";
+        retireWorker(worker);
+        scheduleSpareWorkers();
+    }
+}
+
+void BrowserProcessPoolPrivate::onProcessError(QProcess::ProcessError error)
+{
+    /* For crashes, finished() is emitted too */
+    if (error != QProcess::FailedToStart) return;
+
+    BrowserWorker *worker = workerForProcess(sender());
+    if (worker == 0) return;
+
+    BLAME() << "Couldn't start the browser process:" <<
+        worker->process->errorString();
+    /* Trying again would not help */
+    m_disabled = true;
+    m_respawnTimer.stop();
+    removeWorker(worker);
+}
+
+void BrowserProcessPoolPrivate::onProcessFinished()
+{
+    BrowserWorker *worker = workerForProcess(sender());
+    if (worker == 0) return;
+
+    TRACE() << "Browser process exited:" << worker->process->exitCode();
+    bool wasIdle = m_idleWorkers.contains(worker);
+    if (worker->retiring) {
+        /* We asked it to */
+    } else if (worker->startTime.elapsed() < minWorkerLifetime) {
+        m_spawnFailures++;
+        BLAME() << "Browser process exited after" <<
+            worker->startTime.elapsed() << "ms, failure" << m_spawnFailures;
+        if (m_spawnFailures >= maxSpawnFailures) {
+            BLAME() << "Giving up on the browser process";
+            m_disabled = true;
+        }
+    } else {
+        m_spawnFailures = 0;
+    }
+    removeWorker(worker);
+
+    if (wasIdle) {
+        scheduleSpareWorkers();
+    }
+}
+
+BrowserProcessPool::BrowserProcessPool(QObject *parent):
+    QObject(parent),
+    d_ptr(new BrowserProcessPoolPrivate(this))
+{
+}
+
+BrowserProcessPool::~BrowserProcessPool()
+{
+}
+
+BrowserProcessPool *BrowserProcessPool::instance()
+{
+    if (m_instance == 0) {
+        m_instance = new BrowserProcessPool();
+    }
+
+    return m_instance;
+}
+
+bool BrowserProcessPool::isAvailable() const
+{
+    Q_D(const BrowserProcessPool);
+    return !d->m_disabled;
+}
+
+RemoteRequestClient *BrowserProcessPool::takeClient(uint identity)
+{
+    Q_D(BrowserProcessPool);
+
+    BrowserWorker *worker = d->takeWorker(identity);
+    if (worker == 0) {
+        worker = d->spawnWorker();
+        if (worker == 0) return 0;
+    }
+
+    worker->used = true;
+    worker->identity = identity;
+    worker->requestCount++;
+    worker->users++;
+
+    /* Replace the spare process we might have taken */
+    d->scheduleSpareWorkers();
+    return worker->client;
+}
+
+void BrowserProcessPool::releaseClient(RemoteRequestClient *client,
+                                       int requestId)
+{
+    Q_D(BrowserProcessPool);
+
+    BrowserWorker *worker = d->workerForClient(client);
+    if (worker == 0) return;
+
+    /* This does nothing if the request has completed already */
+    client->cancel(requestId);
+
+    worker->users--;
+    if (worker->users == 0) {
+        d->makeIdle(worker);
+    }
+}
+
+#include "browser-process-pool.moc"
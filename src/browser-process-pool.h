@@ -0,0 +1,66 @@
+/*
+ * This file is part of signon-ui
+ *
+ * Copyright (C) 2014 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIGNON_UI_BROWSER_PROCESS_POOL_H
+#define SIGNON_UI_BROWSER_PROCESS_POOL_H
+
+#include <QObject>
+
+namespace SignOnUi {
+
+class RemoteRequestClient;
+
+class BrowserProcessPoolPrivate;
+class BrowserProcessPool: public QObject
+{
+    Q_OBJECT
+
+public:
+    ~BrowserProcessPool();
+
+    static BrowserProcessPool *instance();
+
+    /* False if the browser process cannot be started, or keeps exiting
+     * right after being started */
+    bool isAvailable() const;
+
+    /* Returns a client connected to a browser process which serves no
+     * other identity; the process is reserved until each of the requests
+     * started on the client is given back with releaseClient(). */
+    RemoteRequestClient *takeClient(uint identity);
+    /* If the request is still running, it is canceled. */
+    void releaseClient(RemoteRequestClient *client, int requestId);
+
+Q_SIGNALS:
+    /* The process serving the client exited: the client is no longer
+     * valid */
+    void clientLost(RemoteRequestClient *client);
+
+protected:
+    explicit BrowserProcessPool(QObject *parent = 0);
+
+private:
+    BrowserProcessPoolPrivate *d_ptr;
+    Q_DECLARE_PRIVATE(BrowserProcessPool)
+};
+
+} // namespace
+
+#endif // SIGNON_UI_BROWSER_PROCESS_POOL_H
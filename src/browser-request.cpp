@@ -21,32 +21,45 @@
 #include "browser-request.h"
 
 #include "animation-label.h"
+#include "browser-network-access-manager.h"
 #include "cookie-jar-manager.h"
 #include "debug.h"
 #include "dialog.h"
 #include "http-warning.h"
 #include "i18n.h"
+#include "load-retry-policy.h"
+#include "process-memory.h"
 
+#include <QCoreApplication>
 #include <QDBusArgument>
 #include <QDesktopServices>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QHash>
 #include <QIcon>
+#include <QJsonArray>
+#include <QJsonDocument>
 #include <QLabel>
 #include <QNetworkCookie>
 #include <QNetworkReply>
 #include <QNetworkRequest>
+#include <QPaintEvent>
+#include <QPainter>
 #include <QPixmap>
 #include <QPointer>
 #include <QProgressBar>
 #include <QPushButton>
 #include <QRegExp>
+#include <QSet>
 #include <QSettings>
 #include <QSslError>
+#include <QStandardPaths>
 #include <QStackedLayout>
 #include <QStatusBar>
-#include <QTimer>
 #include <QVBoxLayout>
 #include <QWebElement>
 #include <QWebFrame>
+#include <QWebSettings>
 #include <QWebView>
 #include <SignOn/uisessiondata_priv.h>
 
@@ -68,6 +81,11 @@ static const QString keyLoginButton = QString("LoginButton");
 static const QString keyInternalLinksPattern = QString("InternalLinksPattern");
 static const QString keyExternalLinksPattern = QString("ExternalLinksPattern");
 static const QString keyAllowedUrls = QString("AllowedUrls");
+static const QString keyBlockedResourcesPattern =
+    QString("BlockedResourcesPattern");
+static const QString keyAllowedResourcesPattern =
+    QString("AllowedResourcesPattern");
+static const QString keyPrefetchOpenUrl = QString("PrefetchOpenUrl");
 static const QString valueAlwaysOn = QString("alwaysOn");
 static const QString valueAlwaysOff = QString("alwaysOff");
 
@@ -76,22 +94,88 @@ static const QString keyCookies = QString("Cookies");
 static const QString keyAllowedSchemes = QString("AllowedSchemes");
 static const QString keyIgnoreSslErrors = QString("IgnoreSslErrors");
 
-static bool pathsAreEqual(const QString &p1, const QString &p2)
+/* Navigation timings of all the requests served by this process, per host;
+ * useful to find out which providers need tuning in webkit-options.d. */
+struct HostTimings {
+    HostTimings(): navigations(0), totalFirstByteTime(0),
+        maxFirstByteTime(0), totalTime(0) {}
+    int navigations;
+    qint64 totalFirstByteTime;
+    qint64 maxFirstByteTime;
+    qint64 totalTime;
+};
+static QHash<QString,HostTimings> hostTimings;
+/* Hosts beyond this number are not accounted for */
+static const int maxTimedHosts = 64;
+
+static LoadRetryPolicy::ErrorClass errorClass(QNetworkReply::NetworkError error)
 {
-    static QRegExp regExp("/*$");
-    QString p1copy(p1);
-    QString p2copy(p2);
-    return p1copy.remove(regExp) == p2copy.remove(regExp);
+    switch (error) {
+    case QNetworkReply::OperationCanceledError:
+        return LoadRetryPolicy::CanceledError;
+    case QNetworkReply::HostNotFoundError:
+        return LoadRetryPolicy::NameResolutionError;
+    case QNetworkReply::SslHandshakeFailedError:
+        return LoadRetryPolicy::SslError;
+    default:
+        break;
+    }
+
+    if (error >= QNetworkReply::ContentAccessDenied &&
+        error <= QNetworkReply::UnknownContentError) {
+        return LoadRetryPolicy::HttpError;
+#if QT_VERSION >= QT_VERSION_CHECK(5, 3, 0)
+    } else if (error >= QNetworkReply::InternalServerError &&
+               error <= QNetworkReply::UnknownServerError) {
+        return LoadRetryPolicy::ServerError;
+#endif
+    } else if (error != QNetworkReply::NoError) {
+        return LoadRetryPolicy::ConnectionError;
+    }
+    return LoadRetryPolicy::UnknownError;
 }
 
+/* WebKit features which can be turned on or off in the webkit-options.d
+ * files; when a key is not set, the attribute gets its default value, or the
+ * global QWebSettings value if the default is -1. */
+static const struct {
+    const char *key;
+    QWebSettings::WebAttribute attribute;
+    int defaultValue;
+} webAttributes[] = {
+    { "JavascriptEnabled", QWebSettings::JavascriptEnabled, -1 },
+    { "PluginsEnabled", QWebSettings::PluginsEnabled, -1 },
+    { "JavaEnabled", QWebSettings::JavaEnabled, -1 },
+    { "AutoLoadImages", QWebSettings::AutoLoadImages, -1 },
+    { "DnsPrefetchEnabled", QWebSettings::DnsPrefetchEnabled, -1 },
+    { "LocalStorageEnabled", QWebSettings::LocalStorageEnabled, -1 },
+    { "OfflineStorageDatabaseEnabled",
+        QWebSettings::OfflineStorageDatabaseEnabled, -1 },
+    { "OfflineWebApplicationCacheEnabled",
+        QWebSettings::OfflineWebApplicationCacheEnabled, -1 },
+};
+
 class WebPage: public QWebPage
 {
     Q_OBJECT
 
 public:
-    WebPage(QObject *parent = 0): QWebPage(parent) {}
+    /* The network access manager outlives the page: it's not owned by it */
+    WebPage(BrowserNetworkAccessManager *manager, QObject *parent = 0):
+        QWebPage(parent),
+        m_networkAccessManager(manager)
+    {
+        setNetworkAccessManager(m_networkAccessManager);
+        QObject::connect(m_networkAccessManager,
+                         SIGNAL(finalUrlReached(const QUrl&)),
+                         this, SIGNAL(finalUrlReached(const QUrl&)));
+    }
     ~WebPage() {}
 
+    BrowserNetworkAccessManager *browserNetworkAccessManager() const {
+        return m_networkAccessManager;
+    }
+
     void setUserAgent(const QString &userAgent) { m_userAgent = userAgent; }
 
     void setExternalLinksPattern(const QString &pattern) {
@@ -113,7 +197,10 @@ public:
             QRegExp(pattern, Qt::CaseInsensitive, QRegExp::RegExp2);
     }
 
-    void setFinalUrl(const QUrl &url) { m_finalUrl = url; }
+    void setFinalUrl(const QUrl &url) {
+        m_finalUrl = url;
+        m_networkAccessManager->setFinalUrl(url);
+    }
 
 protected:
     // reimplemented virtual methods
@@ -135,8 +222,7 @@ protected:
         /* We generally don't need to load the final URL, so skip loading it.
          * If this behaviour is not desired for some requests, then just avoid
          * calling setFinalUrl() */
-        if (url.host() == m_finalUrl.host() &&
-            pathsAreEqual(url.path(), m_finalUrl.path())) {
+        if (BrowserNetworkAccessManager::matchesFinalUrl(url, m_finalUrl)) {
             Q_EMIT finalUrlReached(url);
             return false;
         }
@@ -149,6 +235,9 @@ protected:
             return false;
         }
         /* Handle all other requests internally. */
+        if (frame == mainFrame()) {
+            m_networkAccessManager->expectNavigation(url);
+        }
         return true;
     }
 
@@ -159,6 +248,7 @@ private:
     bool urlIsBlocked(QUrl url) const;
 
 private:
+    BrowserNetworkAccessManager *m_networkAccessManager;
     QString m_userAgent;
     QRegExp m_externalLinksPattern;
     QRegExp m_internalLinksPattern;
@@ -200,6 +290,49 @@ bool WebPage::urlIsBlocked(QUrl url) const {
     return false;
 }
 
+/* Exposed to the login page's javascript, to let us know when the login
+ * fields have been added to the DOM. */
+class LoginFieldsNotifier: public QObject
+{
+    Q_OBJECT
+
+public:
+    LoginFieldsNotifier(QObject *parent = 0): QObject(parent) {}
+    ~LoginFieldsNotifier() {}
+
+    Q_INVOKABLE void fieldsReady() { Q_EMIT ready(); }
+
+Q_SIGNALS:
+    void ready();
+};
+
+/* Invokes the notifier as soon as all the elements matching the selectors
+ * (given as a JSON array in %1) exist in the document. */
+static const char loginFieldsWatcherScript[] =
+    "(function() {"
+    "  var selectors = %1;"
+    "  function found() {"
+    "    for (var i = 0; i < selectors.length; i++) {"
+    "      if (!document.querySelector(selectors[i])) return false;"
+    "    }"
+    "    signonUiLoginFields.fieldsReady();"
+    "    return true;"
+    "  }"
+    "  function watch() {"
+    "    if (found()) return;"
+    "    var observer = new MutationObserver(function() {"
+    "      if (found()) observer.disconnect();"
+    "    });"
+    "    observer.observe(document.documentElement,"
+    "                     { childList: true, subtree: true });"
+    "  }"
+    "  if (document.readyState == 'loading') {"
+    "    document.addEventListener('DOMContentLoaded', watch);"
+    "  } else {"
+    "    watch();"
+    "  }"
+    "})();";
+
 class WebView: public QWebView
 {
     Q_OBJECT
@@ -229,11 +362,43 @@ protected:
     }
 
     void paintEvent(QPaintEvent *event) {
-        QPainter painter(this);
-        painter.fillRect(rect(), palette().window());
+        /* The web page paints its own background; only the areas it doesn't
+         * cover need to be filled. */
+        QRegion uncovered = event->region();
+        QWebFrame *frame = page()->mainFrame();
+        uncovered -= QRect(-frame->scrollPosition(), frame->contentsSize());
+        if (!uncovered.isEmpty()) {
+            QPainter painter(this);
+            painter.setClipRegion(uncovered);
+            painter.fillRect(rect(), palette().window());
+        }
         QWebView::paintEvent(event);
     }
 
+    void showEvent(QShowEvent *event) {
+        setPageVisible(true);
+        QWebView::showEvent(event);
+    }
+
+    void hideEvent(QHideEvent *event) {
+        setPageVisible(false);
+        QWebView::hideEvent(event);
+    }
+
+private:
+    void setPageVisible(bool visible) {
+        /* WebKit keeps asking for repaints while the page is animating:
+         * ignore them, rather than marking dirty regions nobody will see.
+         * The pending changes are painted at once when shown again. */
+        setUpdatesEnabled(visible);
+#if QT_VERSION >= QT_VERSION_CHECK(5, 2, 0)
+        /* Lets the page's own scripts and WebKit throttle what they can */
+        page()->setVisibilityState(visible ?
+                                   QWebPage::VisibilityStateVisible :
+                                   QWebPage::VisibilityStateHidden);
+#endif
+    }
+
 private:
     QSize m_preferredSize;
 };
@@ -247,24 +412,36 @@ public:
     BrowserRequestPrivate(BrowserRequest *request);
     ~BrowserRequestPrivate();
 
-    QWidget *buildWebViewPage(const QVariantMap &params);
+    void buildPage(const QVariantMap &params);
+    QWidget *buildWebViewPage();
     QWidget *buildSuccessPage();
     QWidget *buildLoadFailurePage();
     void buildDialog(const QVariantMap &params);
+    void prepare();
     void start();
 
 private Q_SLOTS:
     void onSslErrors(QNetworkReply *reply, const QList<QSslError> &errors);
     void onUrlChanged(const QUrl &url);
+    void onLoadStarted();
+    void onReplyFinished(QNetworkReply *reply);
     void onLoadProgress();
     void onLoadFinished(bool ok);
-    void onFailTimer();
+    void onRetry();
+    void onAbortLoad();
+    void onLoadFailure();
     void onFinished();
     void startProgress();
     void stopProgress();
     void onContentsChanged();
+    void onPageReleased();
+    void onJavaScriptWindowObjectCleared();
+    void onLoginFieldsReady();
 
 private:
+    void disconnectPage();
+    void releasePage();
+    void traceHostTimings();
     void showDialog();
     void setupViewForUrl(const QUrl &url);
     void notifyAuthCompleted();
@@ -286,7 +463,14 @@ private:
     QWidget *m_successPage;
     QWidget *m_loadFailurePage;
     QStackedLayout *m_webViewLayout;
+    /* The page is created first, and it's loaded without any widget; the
+     * dialog and the web view are only created when some user interaction
+     * is required. */
+    WebPage *m_page;
+    /* Reserved for the page, given back when the request is destroyed */
+    BrowserNetworkAccessManager *m_networkAccessManager;
     WebView *m_webView;
+    QSize m_preferredSize;
     AnimationLabel *m_animationLabel;
     HttpWarning *m_httpWarning;
     QUrl finalUrl;
@@ -299,8 +483,17 @@ private:
     QString m_username;
     QString m_password;
     int m_loginCount;
+    /* The login button was clicked before the page finished loading */
+    bool m_earlyLoginPending;
+    LoginFieldsNotifier *m_loginFieldsNotifier;
     bool m_ignoreSslErrors;
-    QTimer m_failTimer;
+    bool m_isLoading;
+    QElapsedTimer m_loadTimer;
+    QSet<QString> m_visitedHosts;
+    qint64 m_rssBeforeRelease;
+    LoadRetryPolicy m_retryPolicy;
+    LoadRetryPolicy::ErrorClass m_lastError;
+    QUrl m_failedUrl;
 };
 
 } // namespace
@@ -310,22 +503,34 @@ BrowserRequestPrivate::BrowserRequestPrivate(BrowserRequest *request):
     q_ptr(request),
     m_dialog(0),
     m_webViewLayout(0),
+    m_page(0),
+    m_networkAccessManager(0),
     m_webView(0),
     m_animationLabel(0),
     m_httpWarning(0),
     m_settings(0),
     m_loginCount(0),
-    m_ignoreSslErrors(false)
+    m_earlyLoginPending(false),
+    m_loginFieldsNotifier(new LoginFieldsNotifier(this)),
+    m_ignoreSslErrors(false),
+    m_isLoading(false),
+    m_rssBeforeRelease(0),
+    m_lastError(LoadRetryPolicy::UnknownError)
 {
-    m_failTimer.setSingleShot(true);
-    m_failTimer.setInterval(3000);
-    QObject::connect(&m_failTimer, SIGNAL(timeout()),
-                     this, SLOT(onFailTimer()));
+    QObject::connect(&m_retryPolicy, SIGNAL(retry()),
+                     this, SLOT(onRetry()));
+    QObject::connect(&m_retryPolicy, SIGNAL(failed()),
+                     this, SLOT(onLoadFailure()));
+    QObject::connect(&m_retryPolicy, SIGNAL(abortLoad()),
+                     this, SLOT(onAbortLoad()));
 }
 
 BrowserRequestPrivate::~BrowserRequestPrivate()
 {
     delete m_dialog;
+    /* The page must be gone before its network access manager is reused */
+    delete m_page;
+    BrowserNetworkAccessManager::release(m_networkAccessManager);
 }
 
 void BrowserRequestPrivate::onSslErrors(QNetworkReply *reply,
@@ -342,12 +547,16 @@ void BrowserRequestPrivate::onUrlChanged(const QUrl &url)
     Q_Q(BrowserRequest);
 
     TRACE() << "Url changed:" << url;
-    m_failTimer.stop();
+    m_retryPolicy.loadProgressed();
+    m_earlyLoginPending = false;
 
-    if (url.host() == finalUrl.host() &&
-        pathsAreEqual(url.path(), finalUrl.path())) {
+    if (BrowserNetworkAccessManager::matchesFinalUrl(url, finalUrl)) {
         responseUrl = url;
-        if (q->embeddedUi() || !m_dialog->isVisible()) {
+        if (m_dialog == 0) {
+            /* The authentication completed without ever needing the UI */
+            onFinished();
+            return;
+        } else if (q->embeddedUi() || !m_dialog->isVisible()) {
             /* Do not show the notification page. */
             m_dialog->accept();
         } else {
@@ -357,41 +566,136 @@ void BrowserRequestPrivate::onUrlChanged(const QUrl &url)
     }
 
     setupViewForUrl(url);
-    m_httpWarning->setVisible(url.scheme() == "http");
+    if (m_httpWarning != 0) {
+        m_httpWarning->setVisible(url.scheme() == "http");
+    }
+}
+
+void BrowserRequestPrivate::onLoadStarted()
+{
+    m_isLoading = true;
+    m_loadTimer.start();
+    m_lastError = LoadRetryPolicy::UnknownError;
+    m_failedUrl.clear();
+    m_retryPolicy.loadStarted(m_page->mainFrame()->requestedUrl().host());
+}
+
+void BrowserRequestPrivate::onReplyFinished(QNetworkReply *reply)
+{
+    /* We are only interested in the navigation hops */
+    if (reply->request().originatingObject() != m_page->mainFrame()) return;
+
+    BrowserNetworkAccessManager::Timing timing =
+        m_page->browserNetworkAccessManager()->timing(reply);
+    QString host = reply->url().host();
+    int status =
+        reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+
+    if (reply->error() != QNetworkReply::NoError) {
+        m_lastError = errorClass(reply->error());
+        m_failedUrl = reply->url();
+    }
+
+    /* Do not log the query: it might contain the authorization code. The
+     * line is built as a single string, so that it can be parsed as a
+     * sequence of key=value pairs. */
+    QString url = QString::fromLatin1(
+        reply->url().toEncoded(QUrl::RemoveQuery | QUrl::RemoveUserInfo));
+    qint64 download = timing.firstByteTime < 0 ? -1 :
+        timing.finishedTime - timing.firstByteTime;
+    QString line = QString("Navigation timing: url=%1 status=%2 tls=%3 "
+                           "ttfb=%4 download=%5 total=%6 cache=%7").
+        arg(url).arg(status).arg(timing.encryptedTime).
+        arg(timing.firstByteTime).arg(download).arg(timing.finishedTime).
+        arg(timing.fromCache ? "true" : "false");
+    TRACE() << qPrintable(line);
+
+    if (timing.fromCache || timing.firstByteTime < 0) return;
+
+    if (!hostTimings.contains(host) &&
+        hostTimings.count() >= maxTimedHosts) return;
+
+    HostTimings &stats = hostTimings[host];
+    stats.navigations++;
+    stats.totalFirstByteTime += timing.firstByteTime;
+    stats.maxFirstByteTime = qMax(stats.maxFirstByteTime,
+                                  timing.firstByteTime);
+    stats.totalTime += timing.finishedTime;
+    m_visitedHosts.insert(host);
+}
+
+void BrowserRequestPrivate::traceHostTimings()
+{
+    foreach (const QString &host, m_visitedHosts) {
+        const HostTimings &stats = hostTimings[host];
+        QString line = QString("Host timing: host=%1 navigations=%2 "
+                               "avg_ttfb=%3 max_ttfb=%4 avg_total=%5").
+            arg(host).arg(stats.navigations).
+            arg(stats.totalFirstByteTime / stats.navigations).
+            arg(stats.maxFirstByteTime).
+            arg(stats.totalTime / stats.navigations);
+        TRACE() << qPrintable(line);
+    }
 }
 
 void BrowserRequestPrivate::onLoadProgress()
 {
-    m_failTimer.stop();
+    m_retryPolicy.loadProgressed();
 }
 
 void BrowserRequestPrivate::onLoadFinished(bool ok)
 {
-    TRACE() << "Load finished" << ok;
+    TRACE() << "Load finished" << ok << "in" << m_loadTimer.elapsed() << "ms";
+    m_isLoading = false;
+
+    if (m_retryPolicy.loadAbandoned()) {
+        TRACE() << "Ignoring the end of a timed out load";
+        return;
+    }
 
     if (!ok) {
-        m_failTimer.start();
+        m_retryPolicy.loadFailed(m_lastError);
         return;
     }
+    m_retryPolicy.loadSucceeded();
+    m_failedUrl.clear();
 
     if (loggingLevel() > 2) {
         /* Dump the HTML */
-        TRACE() << m_webView->page()->mainFrame()->toHtml();
+        TRACE() << m_page->mainFrame()->toHtml();
     }
 
     initializeFields();
 
-    if (!m_dialog->isVisible()) {
+    if (m_dialog == 0 || !m_dialog->isVisible()) {
         if (responseUrl.isEmpty()) {
-            if (!tryAutoLogin())
+            if (m_earlyLoginPending) {
+                /* We already clicked the login button */
+                m_earlyLoginPending = false;
+            } else if (!tryAutoLogin()) {
                 showDialog();
+            }
         } else {
             onFinished();
         }
     }
 }
 
-void BrowserRequestPrivate::onFailTimer()
+void BrowserRequestPrivate::onRetry()
+{
+    if (m_failedUrl.isValid()) {
+        m_page->mainFrame()->load(m_failedUrl);
+    } else {
+        m_page->triggerAction(QWebPage::Reload);
+    }
+}
+
+void BrowserRequestPrivate::onAbortLoad()
+{
+    m_page->triggerAction(QWebPage::Stop);
+}
+
+void BrowserRequestPrivate::onLoadFailure()
 {
     notifyLoadFailed();
 }
@@ -421,14 +725,25 @@ void BrowserRequestPrivate::addBrowserCookies(CookieJar *cookieJar)
         rawCookies = qdbus_cast<RawCookies>(arg);
     }
 
+    /* Clients usually send the same cookies over and over: remember how
+     * they were parsed. */
+    static QHash<QString,QList<QNetworkCookie> > parsedCookies;
+    if (parsedCookies.count() > 256) parsedCookies.clear();
+
     QList<QNetworkCookie> cookies;
     RawCookies::const_iterator i;
     for (i = rawCookies.constBegin(); i != rawCookies.constEnd(); i++) {
-        cookies.append(QNetworkCookie::parseCookies(i.value().toUtf8()));
+        QHash<QString,QList<QNetworkCookie> >::const_iterator parsed =
+            parsedCookies.constFind(i.value());
+        if (parsed == parsedCookies.constEnd()) {
+            parsed = parsedCookies.insert(i.value(),
+                QNetworkCookie::parseCookies(i.value().toUtf8()));
+        }
+        cookies.append(parsed.value());
     }
 
-    TRACE() << "cookies:" << cookies;
-    cookieJar->setCookies(cookies);
+    int changed = cookieJar->mergeCookies(cookies);
+    TRACE() << "cookies:" << cookies << "changed:" << changed;
 }
 
 void BrowserRequestPrivate::startProgress()
@@ -443,58 +758,82 @@ void BrowserRequestPrivate::stopProgress()
     m_webViewLayout->setCurrentIndex(0);
 }
 
-QWidget *BrowserRequestPrivate::buildWebViewPage(const QVariantMap &params)
+void BrowserRequestPrivate::buildPage(const QVariantMap &params)
 {
     Q_Q(BrowserRequest);
 
-    QWidget *dialogPage = new QWidget;
-    m_webViewLayout = new QStackedLayout(dialogPage);
-
-    m_webView = new WebView();
-    WebPage *page = new WebPage(this);
-    QObject::connect(page, SIGNAL(contentsChanged()),
+    uint identity = q->identity();
+    m_networkAccessManager = BrowserNetworkAccessManager::acquire(identity);
+    m_page = new WebPage(m_networkAccessManager, this);
+#if QT_VERSION >= QT_VERSION_CHECK(5, 2, 0)
+    /* Until the page is shown, let WebKit throttle timers and animations;
+     * the WebView will update this when it gets shown or hidden. */
+    m_page->setVisibilityState(QWebPage::VisibilityStatePrerender);
+#endif
+    QObject::connect(m_page, SIGNAL(contentsChanged()),
                      this, SLOT(onContentsChanged()));
-    QObject::connect(page->networkAccessManager(),
+    QObject::connect(m_page->networkAccessManager(),
                      SIGNAL(sslErrors(QNetworkReply*,const QList<QSslError> &)),
                      this, SLOT(onSslErrors(QNetworkReply*,const QList<QSslError> &)));
-    m_webView->setPage(page);
+    QObject::connect(m_page->networkAccessManager(),
+                     SIGNAL(finished(QNetworkReply*)),
+                     this, SLOT(onReplyFinished(QNetworkReply*)));
 
     /* The following couple of lines serve to instruct the QWebPage not to load
      * the final URL, but to block it and emit the finalUrlReached() signal
      * instead.
      */
-    page->setFinalUrl(finalUrl);
-    QObject::connect(page, SIGNAL(finalUrlReached(const QUrl&)),
+    m_page->setFinalUrl(finalUrl);
+    QObject::connect(m_page, SIGNAL(finalUrlReached(const QUrl&)),
                      this, SLOT(onUrlChanged(const QUrl&)));
 
-    /* set a per-identity cookie jar on the page */
-    uint identity = q->identity();
+    /* The identity's manager already holds its cookie jar */
     CookieJarManager *cookieJarManager = CookieJarManager::instance();
-    CookieJar *cookieJar = cookieJarManager->cookieJarForIdentity(identity);
-    addBrowserCookies(cookieJar);
-    page->networkAccessManager()->setCookieJar(cookieJar);
-    /* NetworkAccessManager takes ownership of the cookieJar; we don't want
-     * this */
-    cookieJar->setParent(cookieJarManager);
+    addBrowserCookies(cookieJarManager->cookieJarForIdentity(identity));
 
     const QVariantMap &clientData = q->clientData();
     if (clientData.contains(keyAllowedSchemes)) {
-        page->setAllowedSchemes(clientData[keyAllowedSchemes].toStringList());
+        m_page->setAllowedSchemes(clientData[keyAllowedSchemes].toStringList());
     } else {
         /* by default, allow only https */
-        page->setAllowedSchemes(QStringList("https"));
+        m_page->setAllowedSchemes(QStringList("https"));
     }
 
     m_ignoreSslErrors = clientData.value(keyIgnoreSslErrors, false).toBool();
 
     QUrl url(params.value(SSOUI_KEY_OPENURL).toString());
     setupViewForUrl(url);
-    QObject::connect(m_webView, SIGNAL(urlChanged(const QUrl&)),
+    /* Until there's a view, give the page the same size it will have in
+     * the dialog, for the page layout not to change. */
+    m_page->setViewportSize(m_preferredSize.isValid() ?
+                            m_preferredSize : QSize(400, 300));
+    QObject::connect(m_page->mainFrame(), SIGNAL(urlChanged(const QUrl&)),
                      this, SLOT(onUrlChanged(const QUrl&)));
-    QObject::connect(m_webView, SIGNAL(loadProgress(int)),
+    QObject::connect(m_page->mainFrame(),
+                     SIGNAL(javaScriptWindowObjectCleared()),
+                     this, SLOT(onJavaScriptWindowObjectCleared()));
+    QObject::connect(m_loginFieldsNotifier, SIGNAL(ready()),
+                     this, SLOT(onLoginFieldsReady()));
+    QObject::connect(m_page, SIGNAL(loadStarted()),
+                     this, SLOT(onLoadStarted()));
+    QObject::connect(m_page, SIGNAL(loadProgress(int)),
                      this, SLOT(onLoadProgress()));
-    QObject::connect(m_webView, SIGNAL(loadFinished(bool)),
+    QObject::connect(m_page, SIGNAL(loadFinished(bool)),
                      this, SLOT(onLoadFinished(bool)));
+    m_page->mainFrame()->load(url);
+}
+
+QWidget *BrowserRequestPrivate::buildWebViewPage()
+{
+    QWidget *dialogPage = new QWidget;
+    m_webViewLayout = new QStackedLayout(dialogPage);
+
+    m_webView = new WebView();
+    m_webView->setPage(m_page);
+    if (m_preferredSize.isValid()) {
+        m_webView->setPreferredSize(m_preferredSize);
+    }
+
     QWidget *webViewContainer = new QWidget;
     QVBoxLayout *vLayout = new QVBoxLayout;
     vLayout->setSpacing(0);
@@ -502,18 +841,20 @@ QWidget *BrowserRequestPrivate::buildWebViewPage(const QVariantMap &params)
     vLayout->addWidget(m_webView);
 
     m_httpWarning = new HttpWarning;
-    m_httpWarning->setVisible(false);
+    m_httpWarning->setVisible(m_page->mainFrame()->url().scheme() == "http");
     vLayout->addWidget(m_httpWarning);
 
     m_webViewLayout->addWidget(webViewContainer);
 
     m_animationLabel = new AnimationLabel(":/spinner-26.gif", 0);
-    QObject::connect(m_webView, SIGNAL(loadStarted()),
+    QObject::connect(m_page, SIGNAL(loadStarted()),
                      this, SLOT(startProgress()));
-    QObject::connect(m_webView, SIGNAL(loadFinished(bool)),
+    QObject::connect(m_page, SIGNAL(loadFinished(bool)),
                      this, SLOT(stopProgress()));
     m_webViewLayout->addWidget(m_animationLabel);
-    m_webView->setUrl(url);
+    if (m_isLoading) {
+        startProgress();
+    }
 
     return dialogPage;
 }
@@ -573,7 +914,7 @@ void BrowserRequestPrivate::buildDialog(const QVariantMap &params)
 
     m_dialogLayout = new QStackedLayout(m_dialog);
 
-    m_webViewPage = buildWebViewPage(params);
+    m_webViewPage = buildWebViewPage();
     m_dialogLayout->addWidget(m_webViewPage);
 
     m_successPage = buildSuccessPage();
@@ -582,18 +923,58 @@ void BrowserRequestPrivate::buildDialog(const QVariantMap &params)
     m_loadFailurePage = buildLoadFailurePage();
     m_dialogLayout->addWidget(m_loadFailurePage);
 
+    QObject::connect(m_dialog, SIGNAL(finished(int)),
+                     this, SLOT(onFinished()));
+
     TRACE() << "Dialog was built";
 }
 
+void BrowserRequestPrivate::prepare()
+{
+    Q_Q(BrowserRequest);
+
+    QUrl url(q->parameters().value(SSOUI_KEY_OPENURL).toString());
+    if (url.host().isEmpty()) return;
+
+    /* Resolve the host name and open the connection (going through the proxy,
+     * if any) while the request is still waiting in the queue; the page will
+     * then reuse it, since connections are owned by the identity's network
+     * access manager. */
+    if (url.scheme() != "https" && url.scheme() != "http") return;
+
+    BrowserNetworkAccessManager *nam =
+        BrowserNetworkAccessManager::forIdentity(q->identity());
+#if QT_VERSION >= QT_VERSION_CHECK(5, 2, 0)
+    TRACE() << "Preconnecting to" << url.host();
+    if (url.scheme() == "https") {
+        nam->connectToHostEncrypted(url.host(), url.port(443));
+    } else {
+        nam->connectToHost(url.host(), url.port(80));
+    }
+#endif
+
+    /* Optionally, also download the page into the cache. This is done
+     * without any cookies, so it's useful only for pages which are not
+     * personalized: therefore it must be enabled in the host configuration.
+     */
+    QSettings settings("signon-ui/webkit-options.d/" + url.host(), QString());
+    if (settings.value(keyPrefetchOpenUrl, false).toBool()) {
+        TRACE() << "Prefetching" << url;
+        QNetworkRequest request(url);
+        request.setAttribute(QNetworkRequest::CacheLoadControlAttribute,
+                             QNetworkRequest::PreferCache);
+        QNetworkReply *reply = nam->get(request);
+        QObject::connect(reply, SIGNAL(finished()),
+                         reply, SLOT(deleteLater()));
+    }
+}
+
 void BrowserRequestPrivate::start()
 {
     Q_Q(BrowserRequest);
 
     finalUrl = QUrl(q->parameters().value(SSOUI_KEY_FINALURL).toString());
-    buildDialog(q->parameters());
-
-    QObject::connect(m_dialog, SIGNAL(finished(int)),
-                     this, SLOT(onFinished()));
+    buildPage(q->parameters());
 
     if (q->embeddedUi()) {
         showDialog();
@@ -606,10 +987,19 @@ void BrowserRequestPrivate::onFinished()
 
     TRACE() << "Browser dialog closed";
 
-    QObject::disconnect(m_webView, 0, this, 0);
+    m_retryPolicy.cancel();
+    disconnectPage();
+
+    BrowserNetworkAccessManager::Statistics stats =
+        m_page->browserNetworkAccessManager()->statistics();
+    TRACE() << "Blocked requests:" << stats.blockedRequests <<
+        "bytes:" << stats.blockedBytes <<
+        "- downloaded bytes:" << stats.networkBytes <<
+        "from cache:" << stats.cacheBytes;
+    traceHostTimings();
 
     QVariantMap reply;
-    QUrl url = responseUrl.isEmpty() ? m_webView->url() : responseUrl;
+    QUrl url = responseUrl.isEmpty() ? m_page->mainFrame()->url() : responseUrl;
     reply[SSOUI_KEY_URLRESPONSE] = url.toString();
 
     if (!m_username.isEmpty())
@@ -635,10 +1025,84 @@ void BrowserRequestPrivate::onContentsChanged()
     }
 }
 
+void BrowserRequestPrivate::onJavaScriptWindowObjectCleared()
+{
+    /* If the page is configured for auto-login, watch for the login fields
+     * to appear, instead of waiting for all the page resources to be
+     * loaded. */
+    QWebFrame *frame = m_page->mainFrame();
+    QSettings settings("signon-ui/webkit-options.d/" + frame->url().host(),
+                       QString());
+    QJsonArray selectors;
+    foreach (const QString &key, QStringList() << keyUsernameField <<
+             keyPasswordField << keyLoginButton) {
+        QString selector = settings.value(key).toString();
+        if (selector.isEmpty()) return;
+        selectors.append(selector);
+    }
+
+    frame->addToJavaScriptWindowObject("signonUiLoginFields",
+                                       m_loginFieldsNotifier);
+    QString json =
+        QString::fromUtf8(QJsonDocument(selectors).toJson(QJsonDocument::Compact));
+    frame->evaluateJavaScript(QString::fromLatin1(loginFieldsWatcherScript).
+                              arg(json));
+}
+
+void BrowserRequestPrivate::onLoginFieldsReady()
+{
+    if (!m_isLoading || m_earlyLoginPending || !responseUrl.isEmpty()) return;
+    if (m_dialog != 0 && m_dialog->isVisible()) return;
+
+    TRACE() << "Login fields ready, loading still in progress";
+    initializeFields();
+    if (tryAutoLogin()) {
+        m_earlyLoginPending = true;
+    }
+}
+
+void BrowserRequestPrivate::disconnectPage()
+{
+    QObject::disconnect(m_page, 0, this, 0);
+    QObject::disconnect(m_page->mainFrame(), 0, this, 0);
+    QObject::disconnect(m_page->networkAccessManager(), 0, this, 0);
+    QObject::disconnect(m_loginFieldsNotifier, 0, this, 0);
+}
+
+/* Once the authentication is completed the page is not needed anymore, but
+ * the success page might stay visible for a long time: stop everything the
+ * web page might be running, and free as much memory as possible. */
+void BrowserRequestPrivate::releasePage()
+{
+    if (m_rssBeforeRelease != 0) return;
+    m_rssBeforeRelease = residentSetSize(QCoreApplication::applicationPid());
+
+    disconnectPage();
+    m_page->triggerAction(QWebPage::Stop);
+
+    QObject::connect(m_page, SIGNAL(loadFinished(bool)),
+                     this, SLOT(onPageReleased()));
+    m_page->mainFrame()->setUrl(QUrl("about:blank"));
+}
+
+void BrowserRequestPrivate::onPageReleased()
+{
+    QObject::disconnect(m_page, SIGNAL(loadFinished(bool)),
+                        this, SLOT(onPageReleased()));
+    QWebSettings::clearMemoryCaches();
+
+    qint64 rss = residentSetSize(QCoreApplication::applicationPid());
+    TRACE() << "Page released; RSS:" << rss << "KiB, freed:" <<
+        m_rssBeforeRelease - rss << "KiB";
+}
+
 void BrowserRequestPrivate::showDialog()
 {
     Q_Q(BrowserRequest);
 
+    if (m_dialog == 0) {
+        buildDialog(q->parameters());
+    }
     q->setWidget(m_dialog);
 }
 
@@ -665,13 +1129,15 @@ void BrowserRequestPrivate::setupViewForUrl(const QUrl &url)
     delete m_settings;
     m_settings = new QSettings("signon-ui/webkit-options.d/" + host, QString(), this);
 
-    WebPage *page = qobject_cast<WebPage *>(m_webView->page());
+    WebPage *page = m_page;
 
     if (m_settings->contains(keyViewportWidth) &&
         m_settings->contains(keyViewportHeight)) {
-        QSize viewportSize(m_settings->value(keyViewportWidth).toInt(),
-                           m_settings->value(keyViewportHeight).toInt());
-        m_webView->setPreferredSize(viewportSize);
+        m_preferredSize = QSize(m_settings->value(keyViewportWidth).toInt(),
+                                m_settings->value(keyViewportHeight).toInt());
+        if (m_webView != 0) {
+            m_webView->setPreferredSize(m_preferredSize);
+        }
     }
 
     if (m_settings->contains(keyPreferredWidth)) {
@@ -680,8 +1146,8 @@ void BrowserRequestPrivate::setupViewForUrl(const QUrl &url)
     }
 
     if (m_settings->contains(keyTextSizeMultiplier)) {
-        m_webView->setTextSizeMultiplier(m_settings->value(keyTextSizeMultiplier).
-                                         toReal());
+        page->mainFrame()->setTextSizeMultiplier(
+            m_settings->value(keyTextSizeMultiplier).toReal());
     }
 
     if (m_settings->contains(keyUserAgent)) {
@@ -689,7 +1155,8 @@ void BrowserRequestPrivate::setupViewForUrl(const QUrl &url)
     }
 
     if (m_settings->contains(keyZoomFactor)) {
-        m_webView->setZoomFactor(m_settings->value(keyZoomFactor).toReal());
+        page->mainFrame()->setZoomFactor(m_settings->value(keyZoomFactor).
+                                         toReal());
     }
 
     if (m_settings->contains(keyHorizontalScrollBar)) {
@@ -709,6 +1176,29 @@ void BrowserRequestPrivate::setupViewForUrl(const QUrl &url)
     page->setInternalLinksPattern(m_settings->value(keyInternalLinksPattern).
                                   toString());
     page->setAllowedUrls(m_settings->value(keyAllowedUrls).toString());
+
+    QWebSettings *webSettings = page->settings();
+    for (uint i = 0; i < sizeof(webAttributes) / sizeof(webAttributes[0]); i++) {
+        QString key = QString::fromLatin1(webAttributes[i].key);
+        QWebSettings::WebAttribute attribute = webAttributes[i].attribute;
+        if (m_settings->contains(key)) {
+            webSettings->setAttribute(attribute,
+                                      m_settings->value(key).toBool());
+        } else if (webAttributes[i].defaultValue >= 0) {
+            webSettings->setAttribute(attribute,
+                                      webAttributes[i].defaultValue != 0);
+        } else {
+            webSettings->resetAttribute(attribute);
+        }
+    }
+
+    BrowserNetworkAccessManager *nam = page->browserNetworkAccessManager();
+    nam->setBlockedResourcesPattern(m_settings->
+                                    value(keyBlockedResourcesPattern).
+                                    toString());
+    nam->setAllowedResourcesPattern(m_settings->
+                                    value(keyAllowedResourcesPattern).
+                                    toString());
 }
 
 void BrowserRequestPrivate::notifyAuthCompleted()
@@ -717,13 +1207,18 @@ void BrowserRequestPrivate::notifyAuthCompleted()
      * This is needed because QWebView might still emit loadFinished(false)
      * (which we would interpret as an error) on the final URL, which we don't
      * care about anymore. */
-    QObject::disconnect(m_webView, 0, this, 0);
+    releasePage();
 
     m_dialogLayout->setCurrentWidget(m_successPage);
 }
 
 void BrowserRequestPrivate::notifyLoadFailed()
 {
+    Q_Q(BrowserRequest);
+
+    if (m_dialog == 0) {
+        buildDialog(q->parameters());
+    }
     m_dialogLayout->setCurrentWidget(m_loadFailurePage);
     showDialog();
 }
@@ -740,7 +1235,7 @@ QWebElement BrowserRequestPrivate::initializeField(const QString &settingsKey,
     QString selector = m_settings->value(settingsKey).toString();
     if (selector.isEmpty()) return element;
 
-    QWebFrame *frame = m_webView->page()->mainFrame();
+    QWebFrame *frame = m_page->mainFrame();
     element = frame->findFirstElement(selector);
     if (!element.isNull()) {
         const QVariantMap &params = q->parameters();
@@ -804,6 +1299,30 @@ BrowserRequest::~BrowserRequest()
 {
 }
 
+QString BrowserRequest::dataPathForIdentity(uint identity)
+{
+    /* Same location used by the UbuntuBrowserRequest */
+    return QStandardPaths::writableLocation(QStandardPaths::CacheLocation) +
+        QString("/id-%1").arg(identity);
+}
+
+void BrowserRequest::removeIdentityData(uint identity)
+{
+    BrowserNetworkAccessManager::removeForIdentity(identity);
+
+    QDir dataDir(dataPathForIdentity(identity));
+    if (dataDir.exists()) {
+        TRACE() << "Removing" << dataDir.path();
+        dataDir.removeRecursively();
+    }
+}
+
+void BrowserRequest::prepare()
+{
+    Q_D(BrowserRequest);
+    d->prepare();
+}
+
 void BrowserRequest::start()
 {
     Q_D(BrowserRequest);
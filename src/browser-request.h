@@ -24,6 +24,7 @@
 #include "request.h"
 
 #include <QObject>
+#include <QString>
 
 namespace SignOnUi {
 
@@ -40,7 +41,15 @@ public:
                             QObject *parent = 0);
     ~BrowserRequest();
 
+    /* Directory holding the persistent web storage of the identity; only
+     * the out of process browser keeps data there, since QtWebKit's
+     * localStorage location is shared by all the pages of the process. */
+    static QString dataPathForIdentity(uint identity);
+    static void removeIdentityData(uint identity);
+
     // reimplemented virtual methods
+    bool needsNetwork() const { return true; }
+    void prepare();
     void start();
 
 private:
@@ -140,6 +140,37 @@ void CookieJar::save()
     m_saveTimer.stop();
 }
 
+/* Adds the given cookies to the jar, replacing those having the same name,
+ * domain and path; returns the number of cookies which actually changed. */
+int CookieJar::mergeCookies(const QList<QNetworkCookie> &cookieList)
+{
+    QList<QNetworkCookie> cookies = allCookies();
+    int changed = 0;
+
+    foreach (const QNetworkCookie &cookie, cookieList) {
+        bool found = false;
+        for (int i = 0; i < cookies.count(); i++) {
+            if (!cookies[i].hasSameIdentifier(cookie)) continue;
+            found = true;
+            if (!(cookies[i] == cookie)) {
+                cookies[i] = cookie;
+                changed++;
+            }
+            break;
+        }
+        if (!found) {
+            cookies.append(cookie);
+            changed++;
+        }
+    }
+
+    if (changed > 0) {
+        setAllCookies(cookies);
+        queueSave();
+    }
+    return changed;
+}
+
 void CookieJar::queueSave()
 {
     m_saveTimer.start();
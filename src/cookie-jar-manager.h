@@ -42,10 +42,7 @@ public:
     QList<QNetworkCookie> cookiesForUrl(const QUrl &url) const;
     bool setCookiesFromUrl(const QList<QNetworkCookie> &cookieList,
                            const QUrl &url);
-    void setCookies(const QList<QNetworkCookie> &cookieList) {
-        queueSave();
-        setAllCookies(cookieList);
-    }
+    int mergeCookies(const QList<QNetworkCookie> &cookieList);
 
 public Q_SLOTS:
     void save();
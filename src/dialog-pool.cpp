@@ -0,0 +1,68 @@
+/*
+ * This file is part of signon-ui
+ *
+ * Copyright (C) 2011 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "dialog-pool.h"
+
+#include "dialog.h"
+
+#include <QCoreApplication>
+
+using namespace SignOnUi;
+
+/* Maximum number of idle dialogs kept around for reuse */
+static const int maxSpareDialogs = 4;
+
+static DialogPool *m_instance = 0;
+
+DialogPool::DialogPool(QObject *parent):
+    QObject(parent)
+{
+    QObject::connect(QCoreApplication::instance(), SIGNAL(aboutToQuit()),
+                     this, SLOT(clear()));
+}
+
+DialogPool::~DialogPool()
+{
+    clear();
+    m_instance = 0;
+}
+
+DialogPool *DialogPool::instance()
+{
+    if (m_instance == 0) {
+        m_instance = new DialogPool(QCoreApplication::instance());
+    }
+    return m_instance;
+}
+
+bool DialogPool::add(int fields, Dialog *dialog)
+{
+    if (m_dialogs.contains(fields) || m_dialogs.count() >= maxSpareDialogs) {
+        return false;
+    }
+    m_dialogs.insert(fields, dialog);
+    return true;
+}
+
+void DialogPool::clear()
+{
+    qDeleteAll(m_dialogs);
+    m_dialogs.clear();
+}
@@ -0,0 +1,60 @@
+/*
+ * This file is part of signon-ui
+ *
+ * Copyright (C) 2011 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIGNON_UI_DIALOG_POOL_H
+#define SIGNON_UI_DIALOG_POOL_H
+
+#include <QHash>
+#include <QObject>
+
+namespace SignOnUi {
+
+class Dialog;
+
+/* Dialogs left over by completed requests, keyed by the fields they show:
+ * filling an existing dialog saves building all of its widgets again. The
+ * pool is emptied before the application goes away, as widgets cannot
+ * outlive it. */
+class DialogPool: public QObject
+{
+    Q_OBJECT
+
+public:
+    static DialogPool *instance();
+    ~DialogPool();
+
+    Dialog *take(int fields) { return m_dialogs.take(fields); }
+    /* Returns false if the dialog was not taken: the caller must
+     * delete it */
+    bool add(int fields, Dialog *dialog);
+
+public Q_SLOTS:
+    void clear();
+
+private:
+    explicit DialogPool(QObject *parent);
+
+private:
+    QHash<int,Dialog*> m_dialogs;
+};
+
+} // namespace
+
+#endif // SIGNON_UI_DIALOG_POOL_H
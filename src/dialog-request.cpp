@@ -21,18 +21,26 @@
 #include "dialog-request.h"
 
 #include "debug.h"
+#include "dialog-pool.h"
 #include "dialog.h"
 #include "i18n.h"
 #include "network-access-manager.h"
 
 #include <QDialogButtonBox>
-#include <QEventLoop>
+#include <QEvent>
+#include <QElapsedTimer>
 #include <QFormLayout>
+#include <QFutureWatcher>
+#include <QImage>
 #include <QLabel>
 #include <QLineEdit>
 #include <QNetworkReply>
 #include <QNetworkRequest>
 #include <QPixmap>
+#include <QPointer>
+#include <QTimer>
+#include <QWindow>
+#include <QtConcurrentRun>
 #include <SignOn/UiSessionData>
 #include <SignOn/uisessiondata_priv.h>
 
@@ -41,6 +49,22 @@ using namespace SignOn;
 
 namespace SignOnUi {
 
+static const int captchaTimeout = 10000;
+static const int maxCaptchaAttempts = 3;
+static const int maxCaptchaRedirects = 5;
+
+enum DialogField {
+    MessageField = 1 << 0,
+    UsernameField = 1 << 1,
+    PasswordField = 1 << 2,
+    CaptchaField = 1 << 3
+};
+
+static QImage decodeImage(const QByteArray &data)
+{
+    return QImage::fromData(data);
+}
+
 class DialogRequestPrivate: public QObject
 {
     Q_OBJECT
@@ -51,20 +75,32 @@ public:
     ~DialogRequestPrivate();
 
     void buildDialog(const QVariantMap &params);
+    void prepare();
     void start();
 
+protected:
+    bool eventFilter(QObject *watched, QEvent *event);
+
 private Q_SLOTS:
     void onAccepted();
     void onRejected();
-    void onCaptchaRetrieved(QNetworkReply *reply);
+    void onCaptchaRetrieved();
+    void onCaptchaDecoded();
+    void onCaptchaTimeout();
 
 private:
+    static Dialog *createDialog(int fields);
+    void recycleDialog();
     QString messageFromId(int id);
     void requestCaptcha(const QUrl &url);
+    void retryCaptcha(const QString &reason);
+    void updateCaptchaWidget();
 
 private:
     mutable DialogRequest *q_ptr;
     Dialog *m_dialog;
+    int m_dialogFields;
+    bool m_embeddedUi;
     bool m_queryUsername;
     bool m_queryPassword;
     QLineEdit *m_wUsername;
@@ -72,6 +108,15 @@ private:
     QLineEdit *m_wCaptchaText;
     QLabel *m_wCaptcha;
     QNetworkAccessManager *m_networkAccessManager;
+    QPointer<QNetworkReply> m_captchaReply;
+    QUrl m_captchaUrl;
+    QFutureWatcher<QImage> m_captchaDecoder;
+    QImage m_captchaImage;
+    bool m_captchaFailed;
+    int m_captchaAttempts;
+    int m_captchaRedirects;
+    QTimer m_captchaTimer;
+    QElapsedTimer m_startTime;
 };
 
 } // namespace
@@ -80,19 +125,41 @@ DialogRequestPrivate::DialogRequestPrivate(DialogRequest *request):
     QObject(request),
     q_ptr(request),
     m_dialog(0),
+    m_dialogFields(0),
+    m_embeddedUi(false),
     m_queryUsername(false),
     m_queryPassword(false),
     m_wUsername(0),
     m_wPassword(0),
     m_wCaptchaText(0),
     m_wCaptcha(0),
-    m_networkAccessManager(0)
+    m_networkAccessManager(0),
+    m_captchaFailed(false),
+    m_captchaAttempts(0),
+    m_captchaRedirects(0)
 {
+    /* The timeout can be overridden with SSOUI_CAPTCHA_TIMEOUT (in ms) */
+    int timeout = captchaTimeout;
+    bool isOk;
+    int value = qgetenv("SSOUI_CAPTCHA_TIMEOUT").toInt(&isOk);
+    if (isOk) timeout = value;
+
+    m_captchaTimer.setSingleShot(true);
+    m_captchaTimer.setInterval(timeout);
+    QObject::connect(&m_captchaTimer, SIGNAL(timeout()),
+                     this, SLOT(onCaptchaTimeout()));
+    QObject::connect(&m_captchaDecoder, SIGNAL(finished()),
+                     this, SLOT(onCaptchaDecoded()));
 }
 
 DialogRequestPrivate::~DialogRequestPrivate()
 {
-    delete m_dialog;
+    if (m_captchaReply != 0) {
+        QObject::disconnect(m_captchaReply, 0, this, 0);
+        m_captchaReply->abort();
+        m_captchaReply->deleteLater();
+    }
+    if (m_dialog != 0) recycleDialog();
 }
 
 QString DialogRequestPrivate::messageFromId(int id)
@@ -119,32 +186,134 @@ void DialogRequestPrivate::requestCaptcha(const QUrl &url)
         m_networkAccessManager = NetworkAccessManager::instance();
     }
 
+    m_captchaUrl = url;
+    m_captchaAttempts++;
+
     QNetworkRequest request = QNetworkRequest(url);
-    QNetworkReply *reply = m_networkAccessManager->get(request);
-    if (reply->isFinished()) {
-        onCaptchaRetrieved(reply);
-    } else {
-        // FIXME: handle download asynchronously
-        QEventLoop loop;
-        QObject::connect(reply, SIGNAL(finished()),
-                         &loop, SLOT(quit()));
-        loop.exec();
-        onCaptchaRetrieved(reply);
+    m_captchaReply = m_networkAccessManager->get(request);
+    QObject::connect(m_captchaReply, SIGNAL(finished()),
+                     this, SLOT(onCaptchaRetrieved()));
+    m_captchaTimer.start();
+}
+
+void DialogRequestPrivate::retryCaptcha(const QString &reason)
+{
+    TRACE() << "Captcha download failed:" << reason;
+
+    if (m_captchaAttempts >= maxCaptchaAttempts) {
+        m_captchaFailed = true;
+        updateCaptchaWidget();
+        return;
     }
+
+    requestCaptcha(m_captchaUrl);
 }
 
-void DialogRequestPrivate::buildDialog(const QVariantMap &params)
+void DialogRequestPrivate::updateCaptchaWidget()
 {
-    m_dialog = new Dialog;
-    m_dialog->setObjectName("LoginDialog");
-    m_dialog->setMinimumWidth(400);
+    /* The captcha might be downloaded before the dialog is built */
+    if (m_wCaptcha == 0) return;
+
+    if (!m_captchaImage.isNull()) {
+        m_wCaptcha->setPixmap(QPixmap::fromImage(m_captchaImage));
+    } else if (m_captchaFailed) {
+        m_wCaptcha->setText(QString::fromLatin1("<i>%1</i>").
+                            arg(_("The picture could not be loaded")));
+    }
+}
 
-    QString title = params.value(SSOUI_KEY_TITLE,
-                                 _("Enter your credentials")).toString();
-    m_dialog->setWindowTitle(title);
+Dialog *DialogRequestPrivate::createDialog(int fields)
+{
+    Dialog *dialog = new Dialog;
+    dialog->setObjectName("LoginDialog");
+    dialog->setMinimumWidth(400);
+
+    QFormLayout *formLayout = new QFormLayout(dialog);
+
+    if (fields & MessageField) {
+        QLabel *wMessage = new QLabel;
+        wMessage->setObjectName("Message");
+        formLayout->addRow(wMessage);
+    }
+
+    if (fields & UsernameField) {
+        QLineEdit *wUsername = new QLineEdit;
+        wUsername->setObjectName("UsernameField");
+#ifndef QT_NO_ACCESSIBILITY
+        wUsername->setAccessibleName("username");
+#endif
+        formLayout->addRow(_("Username:"), wUsername);
+    }
+
+    if (fields & PasswordField) {
+        QLineEdit *wPassword = new QLineEdit;
+        wPassword->setObjectName("PasswordField");
+        wPassword->setEchoMode(QLineEdit::Password);
+        formLayout->addRow(_("Password:"), wPassword);
+    }
+
+    if (fields & CaptchaField) {
+        QLabel *wCaptchaMsg = new QLabel(QString::fromLatin1("<i>%1</i>").
+            arg(_("As an additional security measure, please "
+                  "fill in the text from the picture below:")));
+        wCaptchaMsg->setWordWrap(true);
+        formLayout->addRow(wCaptchaMsg);
+
+        QLabel *wCaptcha = new QLabel;
+        wCaptcha->setObjectName("CaptchaImage");
+        wCaptcha->setAlignment(Qt::AlignCenter);
+        formLayout->addRow(wCaptcha);
+        QLineEdit *wCaptchaText = new QLineEdit;
+        wCaptchaText->setObjectName("CaptchaField");
+        formLayout->addRow(_("Text from the picture:"), wCaptchaText);
+    }
+
+    QDialogButtonBox *buttonBox =
+        new QDialogButtonBox(QDialogButtonBox::Ok | QDialogButtonBox::Cancel);
+    connect(buttonBox, SIGNAL(accepted()), dialog, SLOT(accept()));
+    connect(buttonBox, SIGNAL(rejected()), dialog, SLOT(reject()));
+    formLayout->addRow(buttonBox);
 
-    QFormLayout *formLayout = new QFormLayout(m_dialog);
+    TRACE() << "Dialog was built, fields:" << fields;
+    return dialog;
+}
 
+void DialogRequestPrivate::recycleDialog()
+{
+    QObject::disconnect(m_dialog, 0, this, 0);
+    m_dialog->removeEventFilter(this);
+
+    /* Dialogs shown embedded in a foreign window cannot be reused */
+    if (m_embeddedUi) {
+        delete m_dialog;
+        m_dialog = 0;
+        return;
+    }
+
+    m_dialog->hide();
+    m_dialog->setResult(0);
+    QWindow *window = m_dialog->windowHandle();
+    if (window != 0) {
+        window->setTransientParent(0);
+        window->setModality(Qt::NonModal);
+    }
+
+    /* Don't leave any credentials around in the idle dialog */
+    foreach (QLineEdit *lineEdit, m_dialog->findChildren<QLineEdit*>()) {
+        lineEdit->clear();
+        lineEdit->setEnabled(true);
+    }
+    if (m_wCaptcha != 0) m_wCaptcha->clear();
+
+    /* We keep only one spare dialog for each combination of fields */
+    if (!DialogPool::instance()->add(m_dialogFields, m_dialog)) {
+        delete m_dialog;
+    }
+    m_dialog = 0;
+}
+
+void DialogRequestPrivate::buildDialog(const QVariantMap &params)
+{
     QString message = params.value(SSOUI_KEY_MESSAGE).toString();
     if (message.isEmpty()) {
         // Check whether a predefined message id is set
@@ -152,68 +321,87 @@ void DialogRequestPrivate::buildDialog(const QVariantMap &params)
             message = messageFromId(params.value(SSOUI_KEY_MESSAGEID).toInt());
         }
     }
+    m_queryUsername = params.value(SSOUI_KEY_QUERYUSERNAME, false).toBool();
+    bool showUsername = m_queryUsername || params.contains(SSOUI_KEY_USERNAME);
+    m_queryPassword = params.value(SSOUI_KEY_QUERYPASSWORD, false).toBool();
+    bool showPassword = m_queryPassword || params.contains(SSOUI_KEY_PASSWORD);
+    QString captchaUrl = params.value(SSOUI_KEY_CAPTCHAURL).toString();
+
+    m_dialogFields = 0;
+    if (!message.isEmpty()) m_dialogFields |= MessageField;
+    if (showUsername) m_dialogFields |= UsernameField;
+    if (showPassword) m_dialogFields |= PasswordField;
+    if (!captchaUrl.isEmpty()) m_dialogFields |= CaptchaField;
+
+    m_dialog = DialogPool::instance()->take(m_dialogFields);
+    if (m_dialog != 0) {
+        TRACE() << "Reusing dialog, fields:" << m_dialogFields;
+    } else {
+        m_dialog = createDialog(m_dialogFields);
+    }
+
+    QString title = params.value(SSOUI_KEY_TITLE,
+                                 _("Enter your credentials")).toString();
+    m_dialog->setWindowTitle(title);
+
     if (!message.isEmpty()) {
-        QLabel *wMessage = new QLabel(message);
-        wMessage->setObjectName("Message");
-        formLayout->addRow(wMessage);
+        QLabel *wMessage = m_dialog->findChild<QLabel*>("Message");
+        wMessage->setText(message);
     }
 
-    m_queryUsername = params.value(SSOUI_KEY_QUERYUSERNAME, false).toBool();
-    bool showUsername = m_queryUsername || params.contains(SSOUI_KEY_USERNAME);
     if (showUsername) {
-        m_wUsername = new QLineEdit;
-        m_wUsername->setObjectName("UsernameField");
+        m_wUsername = m_dialog->findChild<QLineEdit*>("UsernameField");
         m_wUsername->setEnabled(m_queryUsername);
-#ifndef QT_NO_ACCESSIBILITY
-        m_wUsername->setAccessibleName("username");
-#endif
         m_wUsername->setText(params.value(SSOUI_KEY_USERNAME).toString());
-        formLayout->addRow(_("Username:"), m_wUsername);
     }
 
-    m_queryPassword = params.value(SSOUI_KEY_QUERYPASSWORD, false).toBool();
-    bool showPassword = m_queryPassword || params.contains(SSOUI_KEY_PASSWORD);
     if (showPassword) {
-        m_wPassword = new QLineEdit;
-        m_wPassword->setObjectName("PasswordField");
+        m_wPassword = m_dialog->findChild<QLineEdit*>("PasswordField");
         m_wPassword->setEnabled(m_queryPassword);
-        m_wPassword->setEchoMode(QLineEdit::Password);
         m_wPassword->setText(params.value(SSOUI_KEY_PASSWORD).toString());
-        formLayout->addRow(_("Password:"), m_wPassword);
     }
 
-    QString captchaUrl = params.value(SSOUI_KEY_CAPTCHAURL).toString();
     if (!captchaUrl.isEmpty()) {
-        QLabel *wCaptchaMsg = new QLabel(QString::fromLatin1("<i>%1</i>").
-            arg(_("As an additional security measure, please "
-                  "fill in the text from the picture below:")));
-        wCaptchaMsg->setWordWrap(true);
-        formLayout->addRow(wCaptchaMsg);
+        m_wCaptcha = m_dialog->findChild<QLabel*>("CaptchaImage");
+        m_wCaptchaText = m_dialog->findChild<QLineEdit*>("CaptchaField");
+
+        /* The picture will replace this text once downloaded */
+        m_wCaptcha->setText(QString::fromLatin1("<i>%1</i>").
+                            arg(_("Loading picture...")));
+        if (m_captchaAttempts == 0) {
+            requestCaptcha(QUrl::fromEncoded(captchaUrl.toLatin1()));
+        } else {
+            /* Already requested in prepare() */
+            updateCaptchaWidget();
+        }
+    }
+}
 
-        m_wCaptcha = new QLabel;
-        m_wCaptcha->setAlignment(Qt::AlignCenter);
-        formLayout->addRow(m_wCaptcha);
-        m_wCaptchaText = new QLineEdit;
-        m_wCaptchaText->setObjectName("CaptchaField");
-        formLayout->addRow(_("Text from the picture:"), m_wCaptchaText);
+void DialogRequestPrivate::prepare()
+{
+    Q_Q(DialogRequest);
+
+    m_startTime.start();
 
+    /* Download the captcha while the request is waiting in the queue; the
+     * dialog itself is built only when the request is started, since
+     * queued requests might be canceled. */
+    QString captchaUrl = q->parameters().value(SSOUI_KEY_CAPTCHAURL).toString();
+    if (!captchaUrl.isEmpty()) {
         requestCaptcha(QUrl::fromEncoded(captchaUrl.toLatin1()));
     }
-
-    QDialogButtonBox *buttonBox =
-        new QDialogButtonBox(QDialogButtonBox::Ok | QDialogButtonBox::Cancel);
-    connect(buttonBox, SIGNAL(accepted()), m_dialog, SLOT(accept()));
-    connect(buttonBox, SIGNAL(rejected()), m_dialog, SLOT(reject()));
-    formLayout->addRow(buttonBox);
-
-    TRACE() << "Dialog was built";
 }
 
 void DialogRequestPrivate::start()
 {
     Q_Q(DialogRequest);
 
+    if (!m_startTime.isValid()) {
+        m_startTime.start();
+    }
     buildDialog(q->parameters());
+    m_embeddedUi = q->embeddedUi();
+    m_dialog->installEventFilter(this);
     q->setWidget(m_dialog);
 
     QObject::connect(m_dialog, SIGNAL(accepted()),
@@ -222,6 +410,16 @@ void DialogRequestPrivate::start()
                      this, SLOT(onRejected()));
 }
 
+bool DialogRequestPrivate::eventFilter(QObject *watched, QEvent *event)
+{
+    if (watched == m_dialog && event->type() == QEvent::Show) {
+        /* Measured from the moment the request was queued */
+        TRACE() << "Dialog shown after" << m_startTime.elapsed() << "ms";
+        m_dialog->removeEventFilter(this);
+    }
+    return false;
+}
+
 void DialogRequestPrivate::onAccepted()
 {
     Q_Q(DialogRequest);
@@ -253,28 +451,57 @@ void DialogRequestPrivate::onRejected()
     q->setCanceled();
 }
 
-void DialogRequestPrivate::onCaptchaRetrieved(QNetworkReply *reply)
+void DialogRequestPrivate::onCaptchaRetrieved()
 {
-    TRACE() << "Got captcha";
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    if (reply == 0) return;
+
+    TRACE() << "Got captcha after" << m_startTime.elapsed() << "ms";
 
     reply->deleteLater();
+    m_captchaTimer.stop();
+    m_captchaReply = 0;
 
     if (reply->error()) {
-        // TODO handle error
-        TRACE() << "Got error:" << reply->errorString();
+        retryCaptcha(reply->errorString());
         return;
     }
 
     QUrl newUrl =
         reply->attribute(QNetworkRequest::RedirectionTargetAttribute).toUrl();
     if (newUrl.isEmpty()) {
+        /* Decoding large images can take a while: don't block the UI */
         QByteArray captchaData = reply->readAll();
-        QPixmap pixmap;
-        pixmap.loadFromData(captchaData);
-        m_wCaptcha->setPixmap(pixmap);
-    } else {
+        m_captchaDecoder.setFuture(QtConcurrent::run(decodeImage,
+                                                     captchaData));
+    } else if (m_captchaRedirects++ < maxCaptchaRedirects) {
+        /* Redirections are not counted as attempts */
+        m_captchaAttempts--;
         QUrl url = reply->url().resolved(newUrl);
         requestCaptcha(url);
+    } else {
+        retryCaptcha("too many redirections");
+    }
+}
+
+void DialogRequestPrivate::onCaptchaDecoded()
+{
+    QImage image = m_captchaDecoder.result();
+    if (image.isNull()) {
+        retryCaptcha("invalid image");
+        return;
+    }
+
+    TRACE() << "Captcha decoded after" << m_startTime.elapsed() << "ms";
+    m_captchaImage = image;
+    updateCaptchaWidget();
+}
+
+void DialogRequestPrivate::onCaptchaTimeout()
+{
+    /* This will make the reply emit finished() with an error */
+    if (m_captchaReply != 0) {
+        m_captchaReply->abort();
     }
 }
 
@@ -291,6 +518,12 @@ DialogRequest::~DialogRequest()
 {
 }
 
+void DialogRequest::prepare()
+{
+    Q_D(DialogRequest);
+    d->prepare();
+}
+
 void DialogRequest::start()
 {
     Q_D(DialogRequest);
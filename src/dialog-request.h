@@ -41,6 +41,7 @@ public:
     ~DialogRequest();
 
     // reimplemented virtual methods
+    void prepare();
     void start();
 
 private:
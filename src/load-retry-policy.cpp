@@ -0,0 +1,190 @@
+/*
+ * This file is part of signon-ui
+ *
+ * Copyright (C) 2014 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "load-retry-policy.h"
+
+#include "debug.h"
+
+#include <QSettings>
+
+using namespace SignOnUi;
+
+static const QString keyLoadTimeout = QString("LoadTimeout");
+static const QString keyLoadRetries = QString("LoadRetries");
+static const QString keyLoadRetryDelay = QString("LoadRetryDelay");
+
+/* A failed load is often immediately followed by a new one (redirections
+ * done in javascript, or the user clicking on a link before the page has
+ * loaded), so we always wait a bit before acting. */
+static const int defaultRetryDelay = 500;
+static const int maxRetryDelay = 8000;
+static const int defaultMaxRetries = 2;
+static const int defaultLoadTimeout = 30000;
+
+static LoadRetryPolicy::Statistics m_statistics;
+
+LoadRetryPolicy::LoadRetryPolicy(QObject *parent):
+    QObject(parent),
+    m_lastError(UnknownError),
+    m_retryCount(0),
+    m_maxRetries(defaultMaxRetries),
+    m_retryDelay(defaultRetryDelay),
+    m_loadAbandoned(false)
+{
+    m_retryTimer.setSingleShot(true);
+    QObject::connect(&m_retryTimer, SIGNAL(timeout()),
+                     this, SLOT(onRetryTimer()));
+    m_loadTimer.setSingleShot(true);
+    QObject::connect(&m_loadTimer, SIGNAL(timeout()),
+                     this, SLOT(onLoadTimeout()));
+}
+
+LoadRetryPolicy::~LoadRetryPolicy()
+{
+}
+
+void LoadRetryPolicy::loadStarted(const QString &host)
+{
+    m_retryTimer.stop();
+    m_loadAbandoned = false;
+
+    QSettings settings("signon-ui/webkit-options.d/" + host, QString());
+    m_host = host;
+    m_maxRetries = settings.value(keyLoadRetries, defaultMaxRetries).toInt();
+    m_retryDelay =
+        settings.value(keyLoadRetryDelay, defaultRetryDelay).toInt();
+    m_loadTimer.setInterval(settings.value(keyLoadTimeout,
+                                           defaultLoadTimeout).toInt());
+
+    if (m_loadTimer.interval() > 0) {
+        m_loadTimer.start();
+    }
+}
+
+void LoadRetryPolicy::loadProgressed()
+{
+    if (m_loadAbandoned) return;
+    m_retryTimer.stop();
+}
+
+void LoadRetryPolicy::loadSucceeded()
+{
+    if (m_loadAbandoned) return;
+    m_retryTimer.stop();
+    m_loadTimer.stop();
+
+    m_statistics.loads++;
+    if (m_retryCount > 0) {
+        m_statistics.recoveredLoads++;
+        TRACE() << "Load succeeded after" << m_retryCount << "retries";
+    }
+    m_retryCount = 0;
+}
+
+void LoadRetryPolicy::loadFailed(ErrorClass errorClass)
+{
+    /* The abandoned load reporting its end: we already acted on it */
+    if (m_loadAbandoned) return;
+    retryOrGiveUp(errorClass);
+}
+
+void LoadRetryPolicy::retryOrGiveUp(ErrorClass errorClass)
+{
+    m_loadTimer.stop();
+    m_lastError = errorClass;
+
+    /* Retrying won't help with certificate problems, or when the server
+     * answered with an error page. */
+    if (errorClass == SslError || errorClass == HttpError) {
+        giveUp();
+        return;
+    }
+
+    if (errorClass != CanceledError && m_retryCount >= m_maxRetries) {
+        giveUp();
+        return;
+    }
+
+    TRACE() << "Load failed on" << m_host << "error class:" << errorClass <<
+        "- waiting" << retryDelay() << "ms";
+    m_retryTimer.start(retryDelay());
+}
+
+int LoadRetryPolicy::retryDelay() const
+{
+    /* A name resolution failure right after the network came up is usually
+     * resolved quickly; other errors deserve an exponential backoff. */
+    int delay = m_retryDelay;
+    if (m_lastError != NameResolutionError) {
+        delay <<= qMin(m_retryCount, 4);
+    }
+    return qMin(delay, maxRetryDelay);
+}
+
+void LoadRetryPolicy::cancel()
+{
+    m_retryTimer.stop();
+    m_loadTimer.stop();
+    m_loadAbandoned = false;
+}
+
+LoadRetryPolicy::Statistics LoadRetryPolicy::statistics()
+{
+    return m_statistics;
+}
+
+void LoadRetryPolicy::onRetryTimer()
+{
+    /* No new load was started in the meantime */
+    if (m_retryCount >= m_maxRetries) {
+        giveUp();
+        return;
+    }
+
+    m_retryCount++;
+    m_statistics.retries++;
+    TRACE() << "Retrying load on" << m_host << "attempt" << m_retryCount;
+    Q_EMIT retry();
+}
+
+void LoadRetryPolicy::onLoadTimeout()
+{
+    TRACE() << "Load timed out on" << m_host;
+    /* Stop the load before deciding what to do next: otherwise a retry
+     * would race with the old load, and its late completion would be
+     * taken for the outcome of the new one. */
+    m_loadAbandoned = true;
+    Q_EMIT abortLoad();
+    retryOrGiveUp(ConnectionError);
+}
+
+void LoadRetryPolicy::giveUp()
+{
+    m_retryTimer.stop();
+    m_loadTimer.stop();
+
+    m_statistics.loads++;
+    m_statistics.failures++;
+    TRACE() << "Giving up loading" << m_host << "after" << m_retryCount <<
+        "retries; failed loads:" << m_statistics.failures << "of" <<
+        m_statistics.loads;
+    m_retryCount = 0;
+    Q_EMIT failed();
+}
@@ -0,0 +1,109 @@
+/*
+ * This file is part of signon-ui
+ *
+ * Copyright (C) 2014 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIGNON_UI_LOAD_RETRY_POLICY_H
+#define SIGNON_UI_LOAD_RETRY_POLICY_H
+
+#include <QObject>
+#include <QString>
+#include <QTimer>
+
+namespace SignOnUi {
+
+/* Decides what to do when a web page fails to load: wait for the page to
+ * start a new load by itself, retry loading it, or give up. */
+class LoadRetryPolicy: public QObject
+{
+    Q_OBJECT
+
+public:
+    enum ErrorClass {
+        UnknownError = 0,
+        /* The load was interrupted, usually by another navigation */
+        CanceledError,
+        NameResolutionError,
+        ConnectionError,
+        SslError,
+        /* The server replied with an error (4xx) */
+        HttpError,
+        /* The server is temporarily unable to reply (5xx) */
+        ServerError,
+    };
+
+    struct Statistics {
+        Statistics(): loads(0), recoveredLoads(0), retries(0), failures(0) {}
+        int loads;
+        /* Loads which succeeded after one or more retries */
+        int recoveredLoads;
+        int retries;
+        int failures;
+    };
+
+    explicit LoadRetryPolicy(QObject *parent = 0);
+    ~LoadRetryPolicy();
+
+    /* The defaults can be overridden per host, with the LoadTimeout,
+     * LoadRetries and LoadRetryDelay keys of the webkit-options.d files. */
+    void loadStarted(const QString &host);
+    /* Any sign of activity on the page cancels a pending retry */
+    void loadProgressed();
+    void loadSucceeded();
+    void loadFailed(ErrorClass errorClass = UnknownError);
+    void cancel();
+
+    int retryCount() const { return m_retryCount; }
+    /* Whether the current load timed out and was given up on */
+    bool loadAbandoned() const { return m_loadAbandoned; }
+    /* The interval after which the next retry will happen */
+    int retryDelay() const;
+
+    static Statistics statistics();
+
+Q_SIGNALS:
+    /* The caller should load the current page again */
+    void retry();
+    /* The caller should report the failure to the user */
+    void failed();
+    /* The current load timed out: the caller should stop it. Its completion
+     * will be ignored, and a retry will be requested if appropriate. */
+    void abortLoad();
+
+private Q_SLOTS:
+    void onRetryTimer();
+    void onLoadTimeout();
+
+private:
+    void retryOrGiveUp(ErrorClass errorClass);
+    void giveUp();
+
+private:
+    QString m_host;
+    ErrorClass m_lastError;
+    int m_retryCount;
+    int m_maxRetries;
+    int m_retryDelay;
+    bool m_loadAbandoned;
+    QTimer m_retryTimer;
+    QTimer m_loadTimer;
+};
+
+} // namespace
+
+#endif // SIGNON_UI_LOAD_RETRY_POLICY_H
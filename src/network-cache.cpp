@@ -0,0 +1,137 @@
+/*
+ * This file is part of signon-ui
+ *
+ * Copyright (C) 2014 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "network-cache.h"
+
+#include "debug.h"
+
+#include <QNetworkDiskCache>
+#include <QStandardPaths>
+
+using namespace SignOnUi;
+
+static QNetworkDiskCache *m_diskCache = 0;
+static const qint64 maxCacheSize = 10 * 1024 * 1024;
+
+static QNetworkDiskCache *diskCache()
+{
+    if (m_diskCache == 0) {
+        m_diskCache = new QNetworkDiskCache();
+        m_diskCache->setCacheDirectory(NetworkCache::cacheDirectory());
+        m_diskCache->setMaximumCacheSize(NetworkCache::maximumCacheSize());
+    }
+    return m_diskCache;
+}
+
+/* QNetworkAccessManager takes ownership of its cache, and a
+ * QNetworkDiskCache cannot be used by more than one manager; so every
+ * manager gets one of these objects, which just forward all calls to the
+ * single QNetworkDiskCache instance.
+ */
+NetworkCache::NetworkCache(QObject *parent):
+    QAbstractNetworkCache(parent)
+{
+}
+
+NetworkCache::~NetworkCache()
+{
+}
+
+QString NetworkCache::cacheDirectory()
+{
+    return QStandardPaths::writableLocation(QStandardPaths::CacheLocation) +
+        QStringLiteral("/http");
+}
+
+qint64 NetworkCache::maximumCacheSize()
+{
+    return maxCacheSize;
+}
+
+void NetworkCache::setExcluded(const QUrl &url, bool excluded)
+{
+    if (excluded) {
+        m_excludedUrls.insert(url);
+    } else {
+        m_excludedUrls.remove(url);
+    }
+}
+
+QNetworkCacheMetaData NetworkCache::metaData(const QUrl &url)
+{
+    return diskCache()->metaData(url);
+}
+
+void NetworkCache::updateMetaData(const QNetworkCacheMetaData &metaData)
+{
+    diskCache()->updateMetaData(metaData);
+}
+
+QIODevice *NetworkCache::data(const QUrl &url)
+{
+    return diskCache()->data(url);
+}
+
+bool NetworkCache::remove(const QUrl &url)
+{
+    return diskCache()->remove(url);
+}
+
+qint64 NetworkCache::cacheSize() const
+{
+    return diskCache()->cacheSize();
+}
+
+QIODevice *NetworkCache::prepare(const QNetworkCacheMetaData &metaData)
+{
+    /* The cache is shared by all identities: never store a response which
+     * was personalized for one of them. QNetworkAccessManager strips the
+     * Set-Cookie headers from the meta data, so responses setting cookies
+     * are excluded by the manager, along with those to requests which
+     * carried credentials. */
+    if (m_excludedUrls.remove(metaData.url())) {
+        TRACE() << "Not caching personal reply" << metaData.url();
+        return 0;
+    }
+
+    foreach (const QNetworkCacheMetaData::RawHeader &header,
+             metaData.rawHeaders()) {
+        const QByteArray value = header.second.toLower();
+        if ((qstricmp(header.first.constData(), "Cache-Control") == 0 &&
+             (value.contains("private") || value.contains("no-store"))) ||
+            (qstricmp(header.first.constData(), "Vary") == 0 &&
+             value.contains("cookie"))) {
+            TRACE() << "Not caching" << metaData.url();
+            return 0;
+        }
+    }
+
+    return diskCache()->prepare(metaData);
+}
+
+void NetworkCache::insert(QIODevice *device)
+{
+    diskCache()->insert(device);
+}
+
+void NetworkCache::clear()
+{
+    diskCache()->clear();
+}
@@ -0,0 +1,67 @@
+/*
+ * This file is part of signon-ui
+ *
+ * Copyright (C) 2014 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIGNON_UI_NETWORK_CACHE_H
+#define SIGNON_UI_NETWORK_CACHE_H
+
+#include <QAbstractNetworkCache>
+#include <QObject>
+#include <QSet>
+#include <QUrl>
+
+namespace SignOnUi {
+
+/* A network cache which can be set on any number of QNetworkAccessManager
+ * instances: all of them will share the same on-disk storage.
+ */
+class NetworkCache: public QAbstractNetworkCache
+{
+    Q_OBJECT
+
+public:
+    explicit NetworkCache(QObject *parent = 0);
+    ~NetworkCache();
+
+    static QString cacheDirectory();
+    static qint64 maximumCacheSize();
+
+    /* The response being received for the URL must not be stored: it was
+     * requested with credentials, or it sets cookies */
+    void setExcluded(const QUrl &url, bool excluded);
+
+    // reimplemented virtual methods
+    QNetworkCacheMetaData metaData(const QUrl &url);
+    void updateMetaData(const QNetworkCacheMetaData &metaData);
+    QIODevice *data(const QUrl &url);
+    bool remove(const QUrl &url);
+    qint64 cacheSize() const;
+    QIODevice *prepare(const QNetworkCacheMetaData &metaData);
+    void insert(QIODevice *device);
+
+public Q_SLOTS:
+    void clear();
+
+private:
+    QSet<QUrl> m_excludedUrls;
+};
+
+} // namespace
+
+#endif // SIGNON_UI_NETWORK_CACHE_H
@@ -0,0 +1,60 @@
+/*
+ * This file is part of signon-ui
+ *
+ * Copyright (C) 2014 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "network-monitor.h"
+
+#include "debug.h"
+
+using namespace SignOnUi;
+
+static NetworkMonitor *m_instance = 0;
+
+NetworkMonitor::NetworkMonitor(QObject *parent):
+    QObject(parent)
+{
+    QObject::connect(&m_manager, SIGNAL(onlineStateChanged(bool)),
+                     this, SLOT(onOnlineStateChanged(bool)));
+}
+
+NetworkMonitor::~NetworkMonitor()
+{
+}
+
+NetworkMonitor *NetworkMonitor::instance()
+{
+    if (m_instance == 0) {
+        m_instance = new NetworkMonitor();
+    }
+
+    return m_instance;
+}
+
+bool NetworkMonitor::isOnline() const
+{
+    /* If no bearer plugin is available we don't know anything about the
+     * network configurations: in that case, assume that we are online. */
+    return m_manager.isOnline() || m_manager.allConfigurations().isEmpty();
+}
+
+void NetworkMonitor::onOnlineStateChanged(bool isOnline)
+{
+    TRACE() << "Network online:" << isOnline;
+    Q_EMIT onlineStateChanged(isOnline);
+}
@@ -0,0 +1,55 @@
+/*
+ * This file is part of signon-ui
+ *
+ * Copyright (C) 2014 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIGNON_UI_NETWORK_MONITOR_H
+#define SIGNON_UI_NETWORK_MONITOR_H
+
+#include <QNetworkConfigurationManager>
+#include <QObject>
+
+namespace SignOnUi {
+
+class NetworkMonitor: public QObject
+{
+    Q_OBJECT
+
+public:
+    ~NetworkMonitor();
+
+    static NetworkMonitor *instance();
+
+    bool isOnline() const;
+
+Q_SIGNALS:
+    void onlineStateChanged(bool isOnline);
+
+private Q_SLOTS:
+    void onOnlineStateChanged(bool isOnline);
+
+protected:
+    explicit NetworkMonitor(QObject *parent = 0);
+
+private:
+    QNetworkConfigurationManager m_manager;
+};
+
+} // namespace
+
+#endif // SIGNON_UI_NETWORK_MONITOR_H
@@ -0,0 +1,36 @@
+/*
+ * This file is part of signon-ui
+ *
+ * Copyright (C) 2013 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "process-memory.h"
+
+#include <QByteArray>
+#include <QFile>
+#include <QList>
+#include <QString>
+#include <unistd.h>
+
+qint64 SignOnUi::residentSetSize(qint64 pid)
+{
+    QFile file(QString::fromLatin1("/proc/%1/statm").arg(pid));
+    if (!file.open(QIODevice::ReadOnly)) return 0;
+    QList<QByteArray> fields = file.readAll().split(' ');
+    if (fields.count() < 2) return 0;
+    return fields[1].toLongLong() * sysconf(_SC_PAGESIZE) / 1024;
+}
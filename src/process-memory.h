@@ -0,0 +1,34 @@
+/*
+ * This file is part of signon-ui
+ *
+ * Copyright (C) 2013 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIGNON_UI_PROCESS_MEMORY_H
+#define SIGNON_UI_PROCESS_MEMORY_H
+
+#include <QtGlobal>
+
+namespace SignOnUi {
+
+/* Returns the resident set size of the given process, in KiB, or 0 if it
+ * cannot be read */
+qint64 residentSetSize(qint64 pid);
+
+} // namespace
+
+#endif // SIGNON_UI_PROCESS_MEMORY_H
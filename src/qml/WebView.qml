@@ -18,6 +18,13 @@ WebView {
         }
     }
     onUrlChanged: signonRequest.currentUrl = url
+    onLoadProgressChanged: signonRequest.onLoadProgress(loadProgress)
+
+    Connections {
+        target: signonRequest
+        onReloadRequested: root.reload()
+        onStopRequested: root.stop()
+    }
 
     context: WebContext {
         dataPath: rootDir
@@ -23,33 +23,46 @@
 #include "debug.h"
 #include "dialog.h"
 #include "i18n.h"
+#include "load-retry-policy.h"
+#include "process-memory.h"
 #include "remote-request-interface.h"
+#include "unix-socket-channel.h"
 
 #include <QQmlContext>
 #include <SignOn/uisessiondata_priv.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <QCoreApplication>
 #include <QDir>
 #include <QFile>
+#include <QHash>
 #include <QTimer>
+#include <unistd.h>
 
 using namespace SignOnUi;
 
 namespace SignOnUi {
 
-class BrowserProcessPrivate: public QObject
+static const int memoryReportInterval = 5000;
+
+/* The state of one request: a process can serve several of them at the
+ * same time, each in its own window. */
+class BrowserSession: public QObject
 {
     Q_OBJECT
-    Q_DECLARE_PUBLIC(BrowserProcess)
     Q_PROPERTY(QUrl pageComponentUrl READ pageComponentUrl CONSTANT)
     Q_PROPERTY(QUrl currentUrl READ currentUrl WRITE setCurrentUrl)
     Q_PROPERTY(QUrl startUrl READ startUrl CONSTANT)
     Q_PROPERTY(QUrl finalUrl READ finalUrl CONSTANT)
 
 public:
-    BrowserProcessPrivate(BrowserProcess *request);
-    ~BrowserProcessPrivate();
+    BrowserSession(int requestId, const QVariantMap &params,
+                   RemoteRequestServer *server, QObject *parent = 0);
+    ~BrowserSession();
 
-    void processClientRequest();
+    int requestId() const { return m_requestId; }
+    void start();
 
     void setCurrentUrl(const QUrl &url);
     QUrl pageComponentUrl() const;
@@ -64,54 +77,97 @@ public:
         return m_clientData[SSOUI_KEY_EMBEDDED].toBool();
     }
 
-
 public Q_SLOTS:
     void onLoadStarted();
+    void onLoadProgress(int progress);
     void onLoadFinished(bool ok);
     void cancel();
 
+Q_SIGNALS:
+    void reloadRequested();
+    void stopRequested();
+    void finished(int requestId, const QVariantMap &result);
+    void canceled(int requestId);
+
 private Q_SLOTS:
-    void start(const QVariantMap &params);
-    void onFailTimer();
+    void onLoadFailure();
     void onFinished();
 
 private:
-    void buildDialog(const QVariantMap &params);
+    void buildDialog();
+    void close();
 
 private:
+    int m_requestId;
+    QVariantMap m_params;
+    RemoteRequestServer *m_server;
     Dialog *m_dialog;
     QVariantMap m_clientData;
     QUrl m_currentUrl;
     QUrl m_startUrl;
     QUrl m_finalUrl;
     QUrl m_responseUrl;
-    QString m_host;
+    LoadRetryPolicy m_retryPolicy;
+};
+
+class BrowserProcessPrivate: public QObject
+{
+    Q_OBJECT
+    Q_DECLARE_PUBLIC(BrowserProcess)
+
+public:
+    BrowserProcessPrivate(BrowserProcess *request);
+    ~BrowserProcessPrivate();
+
+    void processClientRequest();
+
+private Q_SLOTS:
+    void start(int requestId, const QVariantMap &params);
+    void cancel(int requestId);
+    void onSessionFinished(int requestId, const QVariantMap &result);
+    void onSessionCanceled(int requestId);
+    void onChannelClosed();
+    void reportMemoryUsage();
+
+private:
+    void endSession(int requestId);
+
+private:
+    QHash<int,BrowserSession*> m_sessions;
     QFile m_input;
     QFile m_output;
+    UnixSocketChannel m_channel;
+    bool m_persistent;
+    int m_requestCount;
     RemoteRequestServer m_server;
-    QTimer m_failTimer;
+    QTimer m_memoryTimer;
     mutable BrowserProcess *q_ptr;
 };
 
 } // namespace
 
-BrowserProcessPrivate::BrowserProcessPrivate(BrowserProcess *process):
-    QObject(process),
-    m_dialog(0),
-    q_ptr(process)
+BrowserSession::BrowserSession(int requestId, const QVariantMap &params,
+                               RemoteRequestServer *server, QObject *parent):
+    QObject(parent),
+    m_requestId(requestId),
+    m_params(params),
+    m_server(server),
+    m_dialog(0)
 {
-    m_failTimer.setSingleShot(true);
-    m_failTimer.setInterval(3000);
-    QObject::connect(&m_failTimer, SIGNAL(timeout()),
-                     this, SLOT(onFailTimer()));
+    QObject::connect(&m_retryPolicy, SIGNAL(retry()),
+                     this, SIGNAL(reloadRequested()));
+    QObject::connect(&m_retryPolicy, SIGNAL(abortLoad()),
+                     this, SIGNAL(stopRequested()));
+    QObject::connect(&m_retryPolicy, SIGNAL(failed()),
+                     this, SLOT(onLoadFailure()));
 }
 
-BrowserProcessPrivate::~BrowserProcessPrivate()
+BrowserSession::~BrowserSession()
 {
     delete m_dialog;
 }
 
-QUrl BrowserProcessPrivate::pageComponentUrl() const
+QUrl BrowserSession::pageComponentUrl() const
 {
     /* We define the X-PageComponent key to let the clients override the QML
      * component to be used to build the authentication page.
@@ -128,25 +184,12 @@ QUrl BrowserProcessPrivate::pageComponentUrl() const
     }
 }
 
-void BrowserProcessPrivate::processClientRequest()
-{
-    TRACE();
-    m_input.open(stdin, QIODevice::ReadOnly);
-    m_output.open(stdout, QIODevice::WriteOnly);
-
-    QObject::connect(&m_server, SIGNAL(started(const QVariantMap&)),
-                     this, SLOT(start(const QVariantMap&)));
-    QObject::connect(&m_server, SIGNAL(canceled()),
-                     this, SLOT(cancel()));
-
-    /* This effectively starts the communication with the client */
-    m_server.setChannels(&m_input, &m_output);
-}
-
-void BrowserProcessPrivate::setCurrentUrl(const QUrl &url)
+void BrowserSession::setCurrentUrl(const QUrl &url)
 {
     TRACE() << "Url changed:" << url;
-    m_failTimer.stop();
+    if (m_dialog == 0) return;
+    m_retryPolicy.loadProgressed();
+    m_server->reportUrlChanged(m_requestId, url);
 
     if (url.host() == m_finalUrl.host() &&
         url.path() == m_finalUrl.path()) {
@@ -162,19 +205,31 @@ void BrowserProcessPrivate::setCurrentUrl(const QUrl &url)
     }
 }
 
-void BrowserProcessPrivate::onLoadStarted()
+void BrowserSession::onLoadStarted()
 {
-    m_failTimer.stop();
+    QUrl url = m_currentUrl.isEmpty() ? m_startUrl : m_currentUrl;
+    m_retryPolicy.loadStarted(url.host());
+    m_server->reportLoadStarted(m_requestId);
 }
 
-void BrowserProcessPrivate::onLoadFinished(bool ok)
+void BrowserSession::onLoadProgress(int progress)
+{
+    m_retryPolicy.loadProgressed();
+    m_server->reportLoadProgress(m_requestId, progress);
+}
+
+void BrowserSession::onLoadFinished(bool ok)
 {
     TRACE() << "Load finished" << ok;
+    if (m_dialog == 0) return;
+    m_server->reportLoadFinished(m_requestId, ok);
 
     if (!ok) {
-        m_failTimer.start();
+        /* The QML WebView doesn't tell us the reason of the failure */
+        m_retryPolicy.loadFailed();
         return;
     }
+    m_retryPolicy.loadSucceeded();
 
     if (!m_dialog->isVisible()) {
         if (m_responseUrl.isEmpty()) {
@@ -187,15 +242,15 @@ void BrowserProcessPrivate::onLoadFinished(bool ok)
     }
 }
 
-void BrowserProcessPrivate::start(const QVariantMap &params)
+void BrowserSession::start()
 {
-    TRACE() << params;
-    if (params.contains(SSOUI_KEY_CLIENT_DATA)) {
-        m_clientData = params[SSOUI_KEY_CLIENT_DATA].toMap();
+    TRACE() << m_params;
+    if (m_params.contains(SSOUI_KEY_CLIENT_DATA)) {
+        m_clientData = m_params[SSOUI_KEY_CLIENT_DATA].toMap();
     }
-    m_finalUrl = params.value(SSOUI_KEY_FINALURL).toString();
-    m_startUrl = params.value(SSOUI_KEY_OPENURL).toString();
-    buildDialog(params);
+    m_finalUrl = m_params.value(SSOUI_KEY_FINALURL).toString();
+    m_startUrl = m_params.value(SSOUI_KEY_OPENURL).toString();
+    buildDialog();
 
     QObject::connect(m_dialog, SIGNAL(finished(int)),
                      this, SLOT(onFinished()));
@@ -213,56 +268,51 @@ void BrowserProcessPrivate::start(const QVariantMap &params)
     m_dialog->setSource(webview);
 }
 
-void BrowserProcessPrivate::cancel()
+void BrowserSession::cancel()
 {
-    Q_Q(BrowserProcess);
-
-    TRACE() << "Client requested to cancel";
-    m_server.setCanceled();
-    if (m_dialog) {
-        m_dialog->close();
-    }
-    Q_EMIT q->finished();
+    TRACE() << "Request" << m_requestId << "canceled";
+    close();
+    Q_EMIT canceled(m_requestId);
 }
 
-void BrowserProcessPrivate::onFailTimer()
+void BrowserSession::onLoadFailure()
 {
-    Q_Q(BrowserProcess);
-
     TRACE() << "Page loading failed";
-    m_server.setResult(QVariantMap());
-    if (m_dialog) {
-        m_dialog->close();
-    }
-    Q_EMIT q->finished();
+    close();
+    Q_EMIT finished(m_requestId, QVariantMap());
 }
 
-void BrowserProcessPrivate::onFinished()
+void BrowserSession::onFinished()
 {
-    Q_Q(BrowserProcess);
-
     TRACE() << "Browser dialog closed";
 
     QVariantMap reply;
     QUrl url = m_responseUrl.isEmpty() ? m_currentUrl : m_responseUrl;
     reply[SSOUI_KEY_URLRESPONSE] = url.toString();
 
-    m_server.setResult(reply);
-    m_dialog->close();
+    close();
+    Q_EMIT finished(m_requestId, reply);
+}
 
-    Q_EMIT q->finished();
+void BrowserSession::close()
+{
+    m_retryPolicy.cancel();
+    if (m_dialog != 0) {
+        QObject::disconnect(m_dialog, 0, this, 0);
+        m_dialog->close();
+    }
 }
 
-void BrowserProcessPrivate::buildDialog(const QVariantMap &params)
+void BrowserSession::buildDialog()
 {
     m_dialog = new Dialog;
 
     QString title;
-    if (params.contains(SSOUI_KEY_TITLE)) {
-        title = params[SSOUI_KEY_TITLE].toString();
-    } else if (params.contains(SSOUI_KEY_CAPTION)) {
+    if (m_params.contains(SSOUI_KEY_TITLE)) {
+        title = m_params[SSOUI_KEY_TITLE].toString();
+    } else if (m_params.contains(SSOUI_KEY_CAPTION)) {
         title = _("Web authentication for %1").
-            arg(params[SSOUI_KEY_CAPTION].toString());
+            arg(m_params[SSOUI_KEY_CAPTION].toString());
     } else {
         title = _("Web authentication");
     }
@@ -272,6 +322,145 @@ void BrowserProcessPrivate::buildDialog(const QVariantMap &params)
     TRACE() << "Dialog was built";
 }
 
+BrowserProcessPrivate::BrowserProcessPrivate(BrowserProcess *process):
+    QObject(process),
+    m_persistent(false),
+    m_requestCount(0),
+    q_ptr(process)
+{
+    m_memoryTimer.setInterval(memoryReportInterval);
+    QObject::connect(&m_memoryTimer, SIGNAL(timeout()),
+                     this, SLOT(reportMemoryUsage()));
+}
+
+BrowserProcessPrivate::~BrowserProcessPrivate()
+{
+    qDeleteAll(m_sessions);
+}
+
+void BrowserProcessPrivate::processClientRequest()
+{
+    TRACE();
+
+    QObject::connect(&m_server, SIGNAL(started(int,const QVariantMap&)),
+                     this, SLOT(start(int,const QVariantMap&)));
+    QObject::connect(&m_server, SIGNAL(canceled(int)),
+                     this, SLOT(cancel(int)));
+
+    /* The client can give us a socket of our own, so that what the
+     * libraries print on stdout doesn't mix with the requests */
+    bool ok = false;
+    int fd = qgetenv("SSOUI_IPC_FD").toInt(&ok);
+    if (ok && fd > 2) {
+        /* Don't let the web processes inherit it */
+        unsetenv("SSOUI_IPC_FD");
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        if (m_channel.setSocketDescriptor(fd)) {
+            TRACE() << "Using IPC socket" << fd;
+            /* Serve requests until the client closes the socket */
+            m_persistent = true;
+            QObject::connect(&m_channel, SIGNAL(disconnected()),
+                             this, SLOT(onChannelClosed()));
+            /* This effectively starts the communication with the client */
+            m_server.setChannels(&m_channel, &m_channel);
+            return;
+        }
+        BLAME() << "Invalid IPC socket" << fd;
+    }
+
+    fcntl(fileno(stdin), F_SETFL,
+          fcntl(fileno(stdin), F_GETFL, 0) | O_NONBLOCK);
+    m_input.open(stdin, QIODevice::ReadOnly);
+    m_output.open(stdout, QIODevice::WriteOnly);
+    m_server.setChannels(&m_input, &m_output);
+}
+
+void BrowserProcessPrivate::start(int requestId, const QVariantMap &params)
+{
+    if (m_sessions.contains(requestId)) {
+        BLAME() << "Request" << requestId << "is already running";
+        return;
+    }
+
+    m_requestCount++;
+    TRACE() << "Serving request" << requestId << "total:" << m_requestCount;
+
+    BrowserSession *session =
+        new BrowserSession(requestId, params, &m_server, this);
+    QObject::connect(session, SIGNAL(finished(int,const QVariantMap&)),
+                     this, SLOT(onSessionFinished(int,const QVariantMap&)));
+    QObject::connect(session, SIGNAL(canceled(int)),
+                     this, SLOT(onSessionCanceled(int)));
+    m_sessions.insert(requestId, session);
+    session->start();
+
+    if (!m_memoryTimer.isActive()) {
+        m_memoryTimer.start();
+    }
+}
+
+void BrowserProcessPrivate::cancel(int requestId)
+{
+    TRACE() << "Client requested to cancel" << requestId;
+    BrowserSession *session = m_sessions.value(requestId);
+    if (session != 0) {
+        session->cancel();
+    } else {
+        /* The client waits for the reply before forgetting the request */
+        m_server.setCanceled(requestId);
+    }
+}
+
+void BrowserProcessPrivate::onSessionFinished(int requestId,
+                                              const QVariantMap &result)
+{
+    m_server.setResult(requestId, result);
+    endSession(requestId);
+}
+
+void BrowserProcessPrivate::onSessionCanceled(int requestId)
+{
+    m_server.setCanceled(requestId);
+    endSession(requestId);
+}
+
+void BrowserProcessPrivate::onChannelClosed()
+{
+    Q_Q(BrowserProcess);
+
+    TRACE() << "Client went away after" << m_requestCount << "requests";
+    qDeleteAll(m_sessions);
+    m_sessions.clear();
+    Q_EMIT q->finished();
+}
+
+void BrowserProcessPrivate::endSession(int requestId)
+{
+    Q_Q(BrowserProcess);
+
+    BrowserSession *session = m_sessions.take(requestId);
+    if (session != 0) {
+        /* We might be called from one of its slots */
+        session->deleteLater();
+    }
+
+    if (m_sessions.isEmpty()) {
+        if (!m_persistent) {
+            Q_EMIT q->finished();
+            return;
+        }
+        /* Let the client decide whether to keep us */
+        m_memoryTimer.stop();
+        reportMemoryUsage();
+    }
+}
+
+void BrowserProcessPrivate::reportMemoryUsage()
+{
+    m_server.reportMemoryUsage(
+        residentSetSize(QCoreApplication::applicationPid()));
+}
+
 BrowserProcess::BrowserProcess(QObject *parent):
     QObject(parent),
     d_ptr(new BrowserProcessPrivate(this))
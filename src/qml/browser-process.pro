@@ -27,14 +27,22 @@ HEADERS = \
     browser-process.h \
     debug.h \
     dialog.h \
+    ../debug.h \
     ../i18n.h \
-    ../remote-request-interface.h
+    ../load-retry-policy.h \
+    ../process-memory.h \
+    ../remote-request-interface.h \
+    ../unix-socket-channel.h
 SOURCES = \
     browser-process.cpp \
     dialog.cpp \
     main.cpp \
+    ../debug.cpp \
     ../i18n.cpp \
-    ../remote-request-interface.cpp
+    ../load-retry-policy.cpp \
+    ../process-memory.cpp \
+    ../remote-request-interface.cpp \
+    ../unix-socket-channel.cpp
 
 DEFINES += \
     DEBUG_ENABLED \
@@ -23,7 +23,6 @@
 #include "debug.h"
 
 #include <QGuiApplication>
-#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -57,7 +56,6 @@ int main(int argc, char **argv)
     TRACE() << "started";
     QGuiApplication app(argc, argv);
     app.setQuitOnLastWindowClosed(false);
-    fcntl(fileno(stdin), F_SETFL, fcntl(fileno(stdin), F_GETFL, 0) | O_NONBLOCK);
     BrowserProcess browserProcess;
 
     QObject::connect(&browserProcess, SIGNAL(finished()),
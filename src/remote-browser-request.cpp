@@ -0,0 +1,169 @@
+/*
+ * This file is part of signon-ui
+ *
+ * Copyright (C) 2014 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "remote-browser-request.h"
+
+#include "browser-process-pool.h"
+#include "debug.h"
+#include "errors.h"
+#include "remote-request-interface.h"
+
+#include <SignOn/uisessiondata_priv.h>
+
+using namespace SignOnUi;
+
+namespace SignOnUi {
+
+class RemoteBrowserRequestPrivate: public QObject
+{
+    Q_OBJECT
+    Q_DECLARE_PUBLIC(RemoteBrowserRequest)
+
+public:
+    RemoteBrowserRequestPrivate(RemoteBrowserRequest *request);
+    ~RemoteBrowserRequestPrivate();
+
+    void start();
+
+private Q_SLOTS:
+    void onResult(int requestId, const QVariantMap &result);
+    void onCanceled(int requestId);
+    void onClientLost(RemoteRequestClient *client);
+
+private:
+    void releaseClient();
+
+private:
+    RemoteRequestClient *m_client;
+    int m_requestId;
+    mutable RemoteBrowserRequest *q_ptr;
+};
+
+} // namespace
+
+RemoteBrowserRequestPrivate::RemoteBrowserRequestPrivate(
+    RemoteBrowserRequest *request):
+    QObject(request),
+    m_client(0),
+    m_requestId(0),
+    q_ptr(request)
+{
+}
+
+RemoteBrowserRequestPrivate::~RemoteBrowserRequestPrivate()
+{
+    if (m_client != 0) {
+        releaseClient();
+    }
+}
+
+void RemoteBrowserRequestPrivate::start()
+{
+    Q_Q(RemoteBrowserRequest);
+
+    BrowserProcessPool *pool = BrowserProcessPool::instance();
+    m_client = pool->takeClient(q->identity());
+    if (m_client == 0) {
+        q->fail(SIGNON_UI_ERROR_INTERNAL,
+                "Couldn't start the browser process");
+        return;
+    }
+
+    /* The client might be shared with other requests */
+    QObject::connect(m_client, SIGNAL(result(int,const QVariantMap&)),
+                     this, SLOT(onResult(int,const QVariantMap&)));
+    QObject::connect(m_client, SIGNAL(canceled(int)),
+                     this, SLOT(onCanceled(int)));
+    QObject::connect(pool, SIGNAL(clientLost(RemoteRequestClient*)),
+                     this, SLOT(onClientLost(RemoteRequestClient*)));
+
+    /* The client data might still be in its D-Bus form */
+    QVariantMap parameters = q->parameters();
+    parameters[SSOUI_KEY_CLIENT_DATA] = q->clientData();
+    m_requestId = m_client->start(parameters);
+}
+
+void RemoteBrowserRequestPrivate::onResult(int requestId,
+                                           const QVariantMap &result)
+{
+    Q_Q(RemoteBrowserRequest);
+
+    if (requestId != m_requestId) return;
+    releaseClient();
+    q->setResult(result);
+}
+
+void RemoteBrowserRequestPrivate::onCanceled(int requestId)
+{
+    Q_Q(RemoteBrowserRequest);
+
+    if (requestId != m_requestId) return;
+    releaseClient();
+    q->setCanceled();
+}
+
+void RemoteBrowserRequestPrivate::onClientLost(RemoteRequestClient *client)
+{
+    Q_Q(RemoteBrowserRequest);
+
+    if (client != m_client) return;
+
+    BLAME() << "Browser process died";
+    m_client = 0;
+    q->fail(SIGNON_UI_ERROR_INTERNAL, "The browser process exited");
+}
+
+void RemoteBrowserRequestPrivate::releaseClient()
+{
+    BrowserProcessPool *pool = BrowserProcessPool::instance();
+    QObject::disconnect(pool, 0, this, 0);
+    QObject::disconnect(m_client, 0, this, 0);
+    pool->releaseClient(m_client, m_requestId);
+    m_client = 0;
+}
+
+RemoteBrowserRequest::RemoteBrowserRequest(const QDBusConnection &connection,
+                                           const QDBusMessage &message,
+                                           const QVariantMap &parameters,
+                                           QObject *parent):
+    Request(connection, message, parameters, parent),
+    d_ptr(new RemoteBrowserRequestPrivate(this))
+{
+}
+
+RemoteBrowserRequest::~RemoteBrowserRequest()
+{
+}
+
+void RemoteBrowserRequest::prepare()
+{
+    /* Creating the pool spawns a process while the request is queued */
+    BrowserProcessPool::instance();
+}
+
+void RemoteBrowserRequest::start()
+{
+    Q_D(RemoteBrowserRequest);
+
+    Request::start();
+    d->start();
+}
+
+#include "remote-browser-request.moc"
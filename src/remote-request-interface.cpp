@@ -21,11 +21,28 @@
 #include "remote-request-interface.h"
 
 #include "debug.h"
+#include "unix-socket-channel.h"
 
 #include <QByteArray>
 #include <QDataStream>
+#include <QElapsedTimer>
 #include <QFile>
+#include <QPointer>
+#include <QSet>
 #include <QSocketNotifier>
+#include <QTimer>
+#include <QUrl>
+#include <QStringList>
+#include <QtEndian>
+#include <SignOn/uisessiondata_priv.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 using namespace SignOnUi;
 
@@ -33,6 +50,159 @@ namespace SignOnUi {
 
 static const QByteArray welcomeMessage = "SsoUi";
 
+/* Every message is sent as a frame made of a fixed size header followed by
+ * the payload; all integers are in network byte order:
+ *   quint8  protocol version
+ *   quint8  operation code
+ *   quint16 flags
+ *   quint32 request id
+ *   quint32 payload length
+ */
+static const quint8 protocolVersion = 3;
+static const int headerSize = 12;
+static const int maxPayloadSize = 64 * 1024 * 1024;
+/* Payloads larger than this are written into a memfd, if the channel can
+ * carry file descriptors; the frame then only holds the payload size, as a
+ * quint32. */
+static const int sharedMemoryThreshold = 64 * 1024;
+static const quint16 sharedMemoryFlag = 0x8000;
+static const int initialBufferSize = 4096;
+/* Progress events are sent in batches, at most this often */
+static const int eventsFlushInterval = 100;
+
+static const QString progressKey = QStringLiteral("Progress");
+static const QString urlKey = QStringLiteral("Url");
+static const QString okKey = QStringLiteral("Ok");
+static const QString residentSizeKey = QStringLiteral("ResidentSize");
+
+/* The payload is a QVariantMap, written as a quint32 entry count followed
+ * by the entries. The keys which we know are sent as a single byte: the
+ * list can only be appended to, since the client and the server might not
+ * have been built from the same sources. */
+static const QStringList &knownKeys()
+{
+    static QStringList keys;
+    if (keys.isEmpty()) {
+        keys << SSOUI_KEY_CLIENT_DATA
+             << SSOUI_KEY_OPENURL
+             << SSOUI_KEY_FINALURL
+             << SSOUI_KEY_URLRESPONSE
+             << SSOUI_KEY_TITLE
+             << SSOUI_KEY_CAPTION
+             << SSOUI_KEY_WINDOWID
+             << SSOUI_KEY_EMBEDDED
+             << SSOUI_KEY_REQUESTID
+             << SSOUI_KEY_IDENTITY
+             << SSOUI_KEY_METHOD
+             << SSOUI_KEY_MECHANISM
+             << SSOUI_KEY_ERROR
+             << SSOUI_KEY_USERNAME
+             << SSOUI_KEY_PASSWORD
+             << QStringLiteral("X-PageComponent")
+             << progressKey
+             << urlKey
+             << okKey
+             << residentSizeKey;
+    }
+    return keys;
+}
+
+enum ValueType {
+    InvalidValue = 0,
+    BoolValue,
+    IntValue,
+    UIntValue,
+    LongLongValue,
+    StringValue,
+    ByteArrayValue,
+    MapValue,
+    /* Anything else goes through QDataStream */
+    GenericValue,
+};
+
+static const int maxMapDepth = 16;
+
+class MessageEncoder
+{
+public:
+    MessageEncoder(QByteArray &buffer): m_buffer(buffer) {}
+
+    void writeMap(const QVariantMap &map);
+
+private:
+    void writeUInt8(quint8 value) { m_buffer.append(char(value)); }
+    void writeUInt32(quint32 value) {
+        uchar data[4];
+        qToBigEndian(value, data);
+        m_buffer.append((const char *)data, sizeof(data));
+    }
+    void writeUInt64(quint64 value) {
+        uchar data[8];
+        qToBigEndian(value, data);
+        m_buffer.append((const char *)data, sizeof(data));
+    }
+    void writeBytes(const QByteArray &bytes) {
+        writeUInt32(bytes.size());
+        m_buffer.append(bytes);
+    }
+    void writeKey(const QString &key);
+    void writeValue(const QVariant &value);
+
+private:
+    QByteArray &m_buffer;
+};
+
+class MessageDecoder
+{
+public:
+    MessageDecoder(const QByteArray &data):
+        m_pos(data.constData()),
+        m_end(data.constData() + data.size()),
+        m_depth(0),
+        m_ok(true)
+    {}
+
+    bool readMap(QVariantMap &map);
+
+private:
+    bool has(qint64 size) {
+        if (m_end - m_pos < size) m_ok = false;
+        return m_ok;
+    }
+    quint8 readUInt8() {
+        if (!has(1)) return 0;
+        return quint8(*m_pos++);
+    }
+    quint32 readUInt32() {
+        if (!has(4)) return 0;
+        quint32 value = qFromBigEndian<quint32>((const uchar *)m_pos);
+        m_pos += 4;
+        return value;
+    }
+    quint64 readUInt64() {
+        if (!has(8)) return 0;
+        quint64 value = qFromBigEndian<quint64>((const uchar *)m_pos);
+        m_pos += 8;
+        return value;
+    }
+    /* The returned data is not copied */
+    QByteArray readBytes() {
+        quint32 size = readUInt32();
+        if (!has(size)) return QByteArray();
+        QByteArray bytes = QByteArray::fromRawData(m_pos, size);
+        m_pos += size;
+        return bytes;
+    }
+    QString readKey();
+    QVariant readValue();
+
+private:
+    const char *m_pos;
+    const char *m_end;
+    int m_depth;
+    bool m_ok;
+};
+
 class IpcHandler: public QObject
 {
     Q_OBJECT
@@ -43,59 +213,253 @@ public:
         Cancel,
         SetResult,
         SetCanceled,
+        /* Events from the server, about a running request */
+        LoadStarted,
+        LoadProgress,
+        UrlChanged,
+        LoadFinished,
+        /* Not related to any request */
+        MemoryUsage,
     };
 
     IpcHandler();
     ~IpcHandler();
 
     void setChannels(QIODevice *readChannel, QIODevice *writeChannel);
-    void write(const QByteArray &data);
+    void write(Code code, int requestId,
+               const QVariantMap &message = QVariantMap(),
+               quint16 flags = 0);
+    /* Frames are queued until flush() is called */
+    void append(Code code, int requestId,
+                const QVariantMap &message = QVariantMap(),
+                quint16 flags = 0);
+    void flush();
 
 Q_SIGNALS:
-    void dataReady(const QByteArray &data);
+    /* The message is decoded from the receive buffer, which is reused for
+     * the next frame. */
+    void messageReady(int code, int requestId, int flags,
+                      const QVariantMap &message);
 
 private Q_SLOTS:
     void onReadyRead();
 
 private:
     bool waitWelcomeMessage();
+    qint64 readInput(char *data, qint64 maxSize);
+    bool parseHeader();
+    void stopReading();
+    int createSharedPayload(const char *data, int size);
+    bool readSharedPayload(QVariantMap &message);
 
 private:
     QIODevice *m_readChannel;
     QIODevice *m_writeChannel;
-    int m_expectedLength;
+    QSocketNotifier *m_notifier;
+    QElapsedTimer m_handshakeTimer;
+    int m_welcomeMatched;
+    qint64 m_skippedBytes;
     bool m_gotWelcomeMessage;
+    bool m_broken;
+    char m_header[headerSize];
+    int m_headerLength;
+    int m_code;
+    int m_flags;
+    int m_requestId;
+    int m_expectedLength;
+    int m_receivedLength;
     QByteArray m_readBuffer;
+    /* Bytes read along with the welcome message, not yet consumed */
+    QByteArray m_pendingInput;
+    int m_pendingPos;
+    QByteArray m_writeBuffer;
+    /* Offset of the frame in m_writeBuffer, memfd holding its payload */
+    QList<QPair<int,int> > m_sharedPayloads;
 };
 
 } // namespace
 
+void MessageEncoder::writeMap(const QVariantMap &map)
+{
+    writeUInt32(map.count());
+    QVariantMap::const_iterator i;
+    for (i = map.constBegin(); i != map.constEnd(); i++) {
+        writeKey(i.key());
+        writeValue(i.value());
+    }
+}
+
+void MessageEncoder::writeKey(const QString &key)
+{
+    int index = knownKeys().indexOf(key);
+    writeUInt8(index + 1);
+    if (index < 0) {
+        writeBytes(key.toUtf8());
+    }
+}
+
+void MessageEncoder::writeValue(const QVariant &value)
+{
+    switch (value.type()) {
+    case QVariant::Invalid:
+        writeUInt8(InvalidValue);
+        break;
+    case QVariant::Bool:
+        writeUInt8(BoolValue);
+        writeUInt8(value.toBool());
+        break;
+    case QVariant::Int:
+        writeUInt8(IntValue);
+        writeUInt32(value.toInt());
+        break;
+    case QVariant::UInt:
+        writeUInt8(UIntValue);
+        writeUInt32(value.toUInt());
+        break;
+    case QVariant::LongLong:
+        writeUInt8(LongLongValue);
+        writeUInt64(value.toLongLong());
+        break;
+    case QVariant::String:
+        writeUInt8(StringValue);
+        writeBytes(value.toString().toUtf8());
+        break;
+    case QVariant::ByteArray:
+        writeUInt8(ByteArrayValue);
+        writeBytes(value.toByteArray());
+        break;
+    case QVariant::Map:
+        writeUInt8(MapValue);
+        writeMap(value.toMap());
+        break;
+    default:
+        {
+            QByteArray data;
+            QDataStream dataStream(&data, QIODevice::WriteOnly);
+            dataStream << value;
+            writeUInt8(GenericValue);
+            writeBytes(data);
+        }
+    }
+}
+
+bool MessageDecoder::readMap(QVariantMap &map)
+{
+    if (++m_depth > maxMapDepth) {
+        m_ok = false;
+        return false;
+    }
+
+    quint32 count = readUInt32();
+    for (quint32 i = 0; i < count && m_ok; i++) {
+        QString key = readKey();
+        QVariant value = readValue();
+        if (m_ok) map.insert(key, value);
+    }
+
+    m_depth--;
+    return m_ok;
+}
+
+QString MessageDecoder::readKey()
+{
+    int index = readUInt8();
+    if (index == 0) {
+        return QString::fromUtf8(readBytes());
+    }
+
+    const QStringList &keys = knownKeys();
+    if (index > keys.count()) {
+        m_ok = false;
+        return QString();
+    }
+    return keys[index - 1];
+}
+
+QVariant MessageDecoder::readValue()
+{
+    switch (readUInt8()) {
+    case InvalidValue:
+        return QVariant();
+    case BoolValue:
+        return bool(readUInt8());
+    case IntValue:
+        return qint32(readUInt32());
+    case UIntValue:
+        return readUInt32();
+    case LongLongValue:
+        return qint64(readUInt64());
+    case StringValue:
+        return QString::fromUtf8(readBytes());
+    case ByteArrayValue:
+        {
+            /* Detach from the receive buffer */
+            QByteArray bytes = readBytes();
+            return QByteArray(bytes.constData(), bytes.size());
+        }
+    case MapValue:
+        {
+            QVariantMap map;
+            readMap(map);
+            return map;
+        }
+    case GenericValue:
+        {
+            QDataStream dataStream(readBytes());
+            QVariant value;
+            dataStream >> value;
+            if (dataStream.status() != QDataStream::Ok) m_ok = false;
+            return value;
+        }
+    default:
+        m_ok = false;
+        return QVariant();
+    }
+}
+
 IpcHandler::IpcHandler():
     QObject(),
     m_readChannel(0),
     m_writeChannel(0),
+    m_notifier(0),
+    m_welcomeMatched(0),
+    m_skippedBytes(0),
+    m_gotWelcomeMessage(false),
+    m_broken(false),
+    m_headerLength(0),
+    m_code(0),
+    m_flags(0),
+    m_requestId(0),
     m_expectedLength(0),
-    m_gotWelcomeMessage(false)
+    m_receivedLength(0),
+    m_pendingPos(0)
 {
+    m_readBuffer.resize(initialBufferSize);
+    /* Reserving the capacity makes resize() never release it */
+    m_writeBuffer.reserve(initialBufferSize);
 }
 
 IpcHandler::~IpcHandler()
 {
+    for (int i = 0; i < m_sharedPayloads.count(); i++) {
+        close(m_sharedPayloads[i].second);
+    }
 }
 
 void IpcHandler::setChannels(QIODevice *readChannel, QIODevice *writeChannel)
 {
     m_readChannel = readChannel;
     m_writeChannel = writeChannel;
+    m_handshakeTimer.start();
     QObject::connect(m_readChannel, SIGNAL(readyRead()),
                      this, SLOT(onReadyRead()));
     /* QFile need special handling */
     QFile *file = qobject_cast<QFile*>(m_readChannel);
     if (file != 0) {
-        QSocketNotifier *notifier = new QSocketNotifier(file->handle(),
-                                                        QSocketNotifier::Read,
-                                                        this);
-        QObject::connect(notifier, SIGNAL(activated(int)),
+        m_notifier = new QSocketNotifier(file->handle(),
+                                         QSocketNotifier::Read,
+                                         this);
+        QObject::connect(m_notifier, SIGNAL(activated(int)),
                          this, SLOT(onReadyRead()));
     }
     onReadyRead();
@@ -105,39 +469,232 @@ void IpcHandler::setChannels(QIODevice *readChannel, QIODevice *writeChannel)
     }
 }
 
-void IpcHandler::write(const QByteArray &data)
+void IpcHandler::write(Code code, int requestId, const QVariantMap &message,
+                       quint16 flags)
 {
-    int length = data.count();
-    m_writeChannel->write((char *)&length, sizeof(length));
-    m_writeChannel->write(data);
+    append(code, requestId, message, flags);
+    flush();
+}
+
+void IpcHandler::append(Code code, int requestId, const QVariantMap &message,
+                        quint16 flags)
+{
+    /* The header is filled in once the payload size is known */
+    int offset = m_writeBuffer.size();
+    m_writeBuffer.resize(offset + headerSize);
+    if (!message.isEmpty()) {
+        MessageEncoder encoder(m_writeBuffer);
+        encoder.writeMap(message);
+    }
+
+    int payloadSize = m_writeBuffer.size() - offset - headerSize;
+    if (payloadSize > sharedMemoryThreshold &&
+        qobject_cast<UnixSocketChannel*>(m_writeChannel) != 0) {
+        int fd = createSharedPayload(m_writeBuffer.constData() + offset +
+                                     headerSize, payloadSize);
+        if (fd >= 0) {
+            m_writeBuffer.resize(offset + headerSize + 4);
+            qToBigEndian<quint32>(payloadSize,
+                                  (uchar *)m_writeBuffer.data() +
+                                  offset + headerSize);
+            m_sharedPayloads.append(qMakePair(offset, fd));
+            flags |= sharedMemoryFlag;
+        }
+    }
+
+    uchar *header = (uchar *)m_writeBuffer.data() + offset;
+    header[0] = protocolVersion;
+    header[1] = code;
+    qToBigEndian<quint16>(flags, header + 2);
+    qToBigEndian<quint32>(requestId, header + 4);
+    qToBigEndian<quint32>(m_writeBuffer.size() - offset - headerSize,
+                          header + 8);
+}
+
+void IpcHandler::flush()
+{
+    if (m_writeBuffer.isEmpty()) return;
+
+    /* Each memfd must be sent along with the first byte of its frame */
+    int written = 0;
+    UnixSocketChannel *channel = qobject_cast<UnixSocketChannel*>(m_writeChannel);
+    for (int i = 0; i < m_sharedPayloads.count(); i++) {
+        int offset = m_sharedPayloads[i].first;
+        m_writeChannel->write(m_writeBuffer.constData() + written,
+                              offset - written);
+        channel->queueDescriptor(m_sharedPayloads[i].second);
+        written = offset;
+    }
+    m_sharedPayloads.clear();
+    m_writeChannel->write(m_writeBuffer.constData() + written,
+                          m_writeBuffer.size() - written);
+    m_writeBuffer.resize(0);
 }
 
 void IpcHandler::onReadyRead()
 {
+    if (m_broken) return;
+
+    /* skip all noise */
+    if (!waitWelcomeMessage()) return;
+
     while (true) {
-        if (m_expectedLength == 0) {
+        if (m_headerLength < headerSize) {
             /* We are beginning a new read */
+            qint64 bytesRead =
+                readInput(m_header + m_headerLength,
+                          headerSize - m_headerLength);
+            if (bytesRead <= 0) break;
+            m_headerLength += bytesRead;
+            if (m_headerLength < headerSize) break;
+            if (!parseHeader()) {
+                stopReading();
+                return;
+            }
+        }
+
+        int neededBytes = m_expectedLength - m_receivedLength;
+        if (neededBytes > 0) {
+            qint64 bytesRead =
+                readInput(m_readBuffer.data() + m_receivedLength,
+                          neededBytes);
+            if (bytesRead <= 0) break;
+            m_receivedLength += bytesRead;
+            if (bytesRead < neededBytes) break;
+        }
+
+        /* The frame is complete */
+        QVariantMap message;
+        if (m_flags & sharedMemoryFlag) {
+            if (!readSharedPayload(message)) {
+                BLAME() << "Invalid shared message, opcode" << m_code;
+                stopReading();
+                return;
+            }
+        } else if (m_expectedLength > 0) {
+            MessageDecoder decoder(QByteArray::fromRawData(m_readBuffer.constData(),
+                                                           m_expectedLength));
+            if (!decoder.readMap(message)) {
+                BLAME() << "Invalid message, opcode" << m_code;
+                stopReading();
+                return;
+            }
+        }
+        m_headerLength = 0;
+        m_receivedLength = 0;
+        /* The receiver might destroy us */
+        QPointer<IpcHandler> guard(this);
+        Q_EMIT messageReady(m_code, m_requestId, m_flags, message);
+        if (guard.isNull() || m_broken) return;
+    }
+}
+
+bool IpcHandler::parseHeader()
+{
+    const uchar *header = (const uchar *)m_header;
+    if (header[0] != protocolVersion) {
+        BLAME() << "Unsupported protocol version" << header[0];
+        return false;
+    }
+
+    m_code = header[1];
+    m_flags = qFromBigEndian<quint16>(header + 2);
+    m_requestId = qFromBigEndian<quint32>(header + 4);
+    quint32 length = qFromBigEndian<quint32>(header + 8);
+    if (length > quint32(maxPayloadSize)) {
+        BLAME() << "Frame too large:" << length;
+        return false;
+    }
+
+    m_expectedLength = length;
+    m_receivedLength = 0;
+    /* The buffer only grows, so that it can be reused for the next frames */
+    if (m_readBuffer.size() < m_expectedLength) {
+        m_readBuffer.resize(m_expectedLength);
+    }
+    return true;
+}
+
+void IpcHandler::stopReading()
+{
+    /* The stream cannot be resynchronized */
+    m_broken = true;
+    QObject::disconnect(m_readChannel, 0, this, 0);
+    if (m_notifier != 0) {
+        m_notifier->setEnabled(false);
+    }
+}
 
-            /* skip all noise */
-            if (!waitWelcomeMessage()) break;
+int IpcHandler::createSharedPayload(const char *data, int size)
+{
+#if defined(SYS_memfd_create) && defined(MFD_ALLOW_SEALING) && \
+    defined(F_ADD_SEALS)
+    int fd = syscall(SYS_memfd_create, "signon-ui-payload",
+                     MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        TRACE() << "memfd_create failed:" << strerror(errno);
+        return -1;
+    }
 
-            int length;
-            int bytesRead = m_readChannel->read((char *)&length,
-                                                sizeof(length));
-            if (bytesRead < int(sizeof(length))) break;
-            m_expectedLength = length;
-            m_readBuffer.clear();
+    int written = 0;
+    while (written < size) {
+        ssize_t ret = ::write(fd, data + written, size - written);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) {
+            BLAME() << "Cannot write payload:" << strerror(errno);
+            close(fd);
+            return -1;
         }
+        written += ret;
+    }
+
+    /* The receiver maps the file: make sure that it cannot shrink under
+     * its feet */
+    if (fcntl(fd, F_ADD_SEALS,
+              F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+        BLAME() << "Cannot seal payload:" << strerror(errno);
+        close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    Q_UNUSED(data);
+    Q_UNUSED(size);
+    return -1;
+#endif
+}
+
+bool IpcHandler::readSharedPayload(QVariantMap &message)
+{
+    UnixSocketChannel *channel = qobject_cast<UnixSocketChannel*>(m_readChannel);
+    if (channel == 0 || m_expectedLength != 4) return false;
+
+    quint32 size = qFromBigEndian<quint32>((const uchar *)m_readBuffer.constData());
+    if (size == 0 || size > quint32(maxPayloadSize)) return false;
+
+    int fd = channel->takeDescriptor();
+    if (fd < 0) return false;
 
-        int neededBytes = m_expectedLength - m_readBuffer.length();
-        QByteArray buffer = m_readChannel->read(neededBytes);
-        m_readBuffer += buffer;
-        if (buffer.length() < neededBytes) break;
-        if (m_readBuffer.length() == m_expectedLength) {
-            Q_EMIT dataReady(m_readBuffer);
-            m_expectedLength = 0;
+    bool ok = false;
+    struct stat info;
+#ifdef F_GET_SEALS
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals >= 0 && (seals & F_SEAL_SHRINK) &&
+        fstat(fd, &info) == 0 && info.st_size >= qint64(size)) {
+        void *data = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            /* Decoded values never point into the mapping */
+            MessageDecoder decoder(QByteArray::fromRawData((const char *)data,
+                                                           size));
+            ok = decoder.readMap(message);
+            munmap(data, size);
         }
     }
+#else
+    Q_UNUSED(info);
+#endif
+    close(fd);
+    return ok;
 }
 
 bool IpcHandler::waitWelcomeMessage()
@@ -146,27 +703,55 @@ bool IpcHandler::waitWelcomeMessage()
 
     /* All Qt applications on the Nexus 4 write some just to stdout when
      * starting. So, skip all input until a well-defined welcome message is
-     * found */
-
-    QByteArray buffer;
-    int startCheckIndex = 0;
-    do {
-        buffer = m_readChannel->peek(40);
-        int found = buffer.indexOf(welcomeMessage, startCheckIndex);
-        int skip = (found >= 0) ? found : buffer.length() - welcomeMessage.length();
-        if (found >= 0) {
-            buffer = m_readChannel->read(skip + welcomeMessage.length());
+     * found; the match state is kept across reads, since the message can be
+     * split between them. */
+    while (true) {
+        /* The read buffer is not in use until the first frame */
+        qint64 bytesRead = m_readChannel->read(m_readBuffer.data(),
+                                               m_readBuffer.size());
+        if (bytesRead <= 0) return false;
+
+        int consumed = 0;
+        while (consumed < bytesRead &&
+               m_welcomeMatched < welcomeMessage.length()) {
+            char c = m_readBuffer.at(consumed++);
+            /* No prefix of the welcome message appears again inside it, so
+             * on a mismatch we can restart from the beginning */
+            if (c != welcomeMessage.at(m_welcomeMatched)) m_welcomeMatched = 0;
+            if (c == welcomeMessage.at(m_welcomeMatched)) m_welcomeMatched++;
+        }
+        m_skippedBytes += consumed;
+
+        if (m_welcomeMatched == welcomeMessage.length()) {
             m_gotWelcomeMessage = true;
+            /* The rest belongs to the first frames */
+            m_pendingInput = QByteArray(m_readBuffer.constData() + consumed,
+                                        bytesRead - consumed);
+            TRACE() << "Handshake completed after" <<
+                m_handshakeTimer.elapsed() << "ms, skipped" <<
+                m_skippedBytes - welcomeMessage.length() << "bytes";
             return true;
         }
-        if (skip > 0) {
-            buffer = m_readChannel->read(skip);
-        } else {
-            buffer.clear();
+    }
+}
+
+qint64 IpcHandler::readInput(char *data, qint64 maxSize)
+{
+    qint64 taken = 0;
+    if (m_pendingPos < m_pendingInput.size()) {
+        taken = qMin(maxSize, qint64(m_pendingInput.size() - m_pendingPos));
+        memcpy(data, m_pendingInput.constData() + m_pendingPos, taken);
+        m_pendingPos += taken;
+        if (m_pendingPos == m_pendingInput.size()) {
+            m_pendingInput.clear();
+            m_pendingPos = 0;
         }
-    } while (!buffer.isEmpty());
+        if (taken == maxSize) return taken;
+    }
 
-    return false;
+    qint64 bytesRead = m_readChannel->read(data + taken, maxSize - taken);
+    if (bytesRead < 0) return taken > 0 ? taken : bytesRead;
+    return taken + bytesRead;
 }
 
 namespace SignOnUi {
@@ -180,38 +765,69 @@ public:
     ~RemoteRequestClientPrivate() {};
 
 private Q_SLOTS:
-    void onDataReady(const QByteArray &data);
+    void onMessageReady(int code, int requestId, int flags,
+                        const QVariantMap &message);
 
 private:
     IpcHandler m_handler;
+    int m_lastRequestId;
+    QSet<int> m_pendingRequests;
     mutable RemoteRequestClient *q_ptr;
 };
 } // namespace
 
 RemoteRequestClientPrivate::RemoteRequestClientPrivate(RemoteRequestClient *client):
     QObject(client),
+    m_lastRequestId(0),
     q_ptr(client)
 {
-    QObject::connect(&m_handler, SIGNAL(dataReady(const QByteArray&)),
-                     this, SLOT(onDataReady(const QByteArray&)));
+    QObject::connect(&m_handler,
+                     SIGNAL(messageReady(int,int,int,const QVariantMap&)),
+                     this,
+                     SLOT(onMessageReady(int,int,int,const QVariantMap&)));
 }
 
-void RemoteRequestClientPrivate::onDataReady(const QByteArray &data)
+void RemoteRequestClientPrivate::onMessageReady(int code, int requestId,
+                                                int flags,
+                                                const QVariantMap &message)
 {
     Q_Q(RemoteRequestClient);
+    Q_UNUSED(flags);
 
-    QDataStream dataStream(data);
-
-    // All messages start with the operation code
-    int code;
-    dataStream >> code;
-    if (code == IpcHandler::SetResult) {
-        QVariantMap result;
-        dataStream >> result;
-        Q_EMIT q->result(result);
-    } else if (code == IpcHandler::SetCanceled) {
-        Q_EMIT q->canceled();
-    } else {
+    if (code == IpcHandler::MemoryUsage) {
+        Q_EMIT q->memoryUsage(message.value(residentSizeKey).toLongLong());
+        return;
+    }
+
+    /* Messages about requests which already completed are dropped */
+    if (!m_pendingRequests.contains(requestId)) {
+        TRACE() << "Message" << code << "for unknown request" << requestId;
+        return;
+    }
+
+    switch (code) {
+    case IpcHandler::SetResult:
+        m_pendingRequests.remove(requestId);
+        Q_EMIT q->result(requestId, message);
+        break;
+    case IpcHandler::SetCanceled:
+        m_pendingRequests.remove(requestId);
+        Q_EMIT q->canceled(requestId);
+        break;
+    case IpcHandler::LoadStarted:
+        Q_EMIT q->loadStarted(requestId);
+        break;
+    case IpcHandler::LoadProgress:
+        Q_EMIT q->loadProgress(requestId, message.value(progressKey).toInt());
+        break;
+    case IpcHandler::UrlChanged:
+        Q_EMIT q->urlChanged(requestId,
+                             QUrl(message.value(urlKey).toString()));
+        break;
+    case IpcHandler::LoadFinished:
+        Q_EMIT q->loadFinished(requestId, message.value(okKey).toBool());
+        break;
+    default:
         qWarning() << "Unsupported opcode" << code;
     }
 }
@@ -232,25 +848,29 @@ void RemoteRequestClient::setChannels(QIODevice *readChannel, QIODevice *writeCh
     d->m_handler.setChannels(readChannel, writeChannel);
 }
 
-void RemoteRequestClient::start(const QVariantMap &parameters)
+int RemoteRequestClient::start(const QVariantMap &parameters)
 {
     Q_D(RemoteRequestClient);
 
-    QByteArray data;
-    QDataStream dataStream(&data, QIODevice::WriteOnly);
-    dataStream << int(IpcHandler::Start);
-    dataStream << parameters;
-    d->m_handler.write(data);
+    /* Request ids are never 0 */
+    d->m_lastRequestId = (d->m_lastRequestId % INT_MAX) + 1;
+    int requestId = d->m_lastRequestId;
+    d->m_pendingRequests.insert(requestId);
+    d->m_handler.write(IpcHandler::Start, requestId, parameters);
+    return requestId;
 }
 
-void RemoteRequestClient::cancel()
+void RemoteRequestClient::cancel(int requestId)
 {
     Q_D(RemoteRequestClient);
+    if (!d->m_pendingRequests.contains(requestId)) return;
+    d->m_handler.write(IpcHandler::Cancel, requestId);
+}
 
-    QByteArray data;
-    QDataStream dataStream(&data, QIODevice::WriteOnly);
-    dataStream << int(IpcHandler::Cancel);
-    d->m_handler.write(data);
+int RemoteRequestClient::pendingRequests() const
+{
+    Q_D(const RemoteRequestClient);
+    return d->m_pendingRequests.count();
 }
 
 namespace SignOnUi {
@@ -263,11 +883,24 @@ public:
     RemoteRequestServerPrivate(RemoteRequestServer *server);
     ~RemoteRequestServerPrivate() {};
 
+    void queueEvent(IpcHandler::Code code, int requestId,
+                    const QVariantMap &message = QVariantMap());
+
 private Q_SLOTS:
-    void onDataReady(const QByteArray &data);
+    void onMessageReady(int code, int requestId, int flags,
+                        const QVariantMap &message);
+    void flushEvents();
 
 private:
+    struct Event {
+        IpcHandler::Code code;
+        int requestId;
+        QVariantMap message;
+    };
+
     IpcHandler m_handler;
+    QList<Event> m_events;
+    QTimer m_flushTimer;
     mutable RemoteRequestServer *q_ptr;
 };
 } // namespace
@@ -276,30 +909,73 @@ RemoteRequestServerPrivate::RemoteRequestServerPrivate(RemoteRequestServer *serv
     QObject(server),
     q_ptr(server)
 {
-    QObject::connect(&m_handler, SIGNAL(dataReady(const QByteArray&)),
-                     this, SLOT(onDataReady(const QByteArray&)));
+    m_flushTimer.setSingleShot(true);
+    m_flushTimer.setInterval(eventsFlushInterval);
+    QObject::connect(&m_flushTimer, SIGNAL(timeout()),
+                     this, SLOT(flushEvents()));
+
+    QObject::connect(&m_handler,
+                     SIGNAL(messageReady(int,int,int,const QVariantMap&)),
+                     this,
+                     SLOT(onMessageReady(int,int,int,const QVariantMap&)));
 }
 
-void RemoteRequestServerPrivate::onDataReady(const QByteArray &data)
+void RemoteRequestServerPrivate::onMessageReady(int code, int requestId,
+                                                int flags,
+                                                const QVariantMap &message)
 {
     Q_Q(RemoteRequestServer);
+    Q_UNUSED(flags);
 
-    QDataStream dataStream(data);
-
-    // All messages start with the operation code
-    int code;
-    dataStream >> code;
     if (code == IpcHandler::Start) {
-        QVariantMap parameters;
-        dataStream >> parameters;
-        Q_EMIT q->started(parameters);
+        Q_EMIT q->started(requestId, message);
     } else if (code == IpcHandler::Cancel) {
-        Q_EMIT q->canceled();
+        Q_EMIT q->canceled(requestId);
     } else {
         qWarning() << "Unsupported opcode" << code;
     }
 }
 
+void RemoteRequestServerPrivate::queueEvent(IpcHandler::Code code,
+                                            int requestId,
+                                            const QVariantMap &message)
+{
+    /* A new progress, URL or memory report replaces the previous one, if
+     * nothing else about the request was queued in between */
+    if (!m_events.isEmpty()) {
+        Event &last = m_events.last();
+        if (last.code == code && last.requestId == requestId &&
+            (code == IpcHandler::LoadProgress ||
+             code == IpcHandler::UrlChanged ||
+             code == IpcHandler::MemoryUsage)) {
+            last.message = message;
+            return;
+        }
+    }
+
+    Event event;
+    event.code = code;
+    event.requestId = requestId;
+    event.message = message;
+    m_events.append(event);
+
+    if (!m_flushTimer.isActive()) {
+        m_flushTimer.start();
+    }
+}
+
+void RemoteRequestServerPrivate::flushEvents()
+{
+    m_flushTimer.stop();
+    if (m_events.isEmpty()) return;
+
+    foreach (const Event &event, m_events) {
+        m_handler.append(event.code, event.requestId, event.message);
+    }
+    m_events.clear();
+    m_handler.flush();
+}
+
 RemoteRequestServer::RemoteRequestServer(QObject *parent):
     QObject(parent),
     d_ptr(new RemoteRequestServerPrivate(this))
@@ -316,25 +992,57 @@ void RemoteRequestServer::setChannels(QIODevice *readChannel, QIODevice *writeCh
     d->m_handler.setChannels(readChannel, writeChannel);
 }
 
-void RemoteRequestServer::setResult(const QVariantMap &result)
+void RemoteRequestServer::setResult(int requestId, const QVariantMap &result)
 {
     Q_D(RemoteRequestServer);
+    /* The events must reach the client before the request completes */
+    d->flushEvents();
+    d->m_handler.write(IpcHandler::SetResult, requestId, result);
+}
 
-    QByteArray data;
-    QDataStream dataStream(&data, QIODevice::WriteOnly);
-    dataStream << int(IpcHandler::SetResult);
-    dataStream << result;
-    d->m_handler.write(data);
+void RemoteRequestServer::setCanceled(int requestId)
+{
+    Q_D(RemoteRequestServer);
+    d->flushEvents();
+    d->m_handler.write(IpcHandler::SetCanceled, requestId);
 }
 
-void RemoteRequestServer::setCanceled()
+void RemoteRequestServer::reportLoadStarted(int requestId)
 {
     Q_D(RemoteRequestServer);
+    d->queueEvent(IpcHandler::LoadStarted, requestId);
+}
+
+void RemoteRequestServer::reportLoadProgress(int requestId, int progress)
+{
+    Q_D(RemoteRequestServer);
+    QVariantMap message;
+    message[progressKey] = progress;
+    d->queueEvent(IpcHandler::LoadProgress, requestId, message);
+}
 
-    QByteArray data;
-    QDataStream dataStream(&data, QIODevice::WriteOnly);
-    dataStream << int(IpcHandler::SetCanceled);
-    d->m_handler.write(data);
+void RemoteRequestServer::reportUrlChanged(int requestId, const QUrl &url)
+{
+    Q_D(RemoteRequestServer);
+    QVariantMap message;
+    message[urlKey] = url.toString();
+    d->queueEvent(IpcHandler::UrlChanged, requestId, message);
+}
+
+void RemoteRequestServer::reportLoadFinished(int requestId, bool ok)
+{
+    Q_D(RemoteRequestServer);
+    QVariantMap message;
+    message[okKey] = ok;
+    d->queueEvent(IpcHandler::LoadFinished, requestId, message);
+}
+
+void RemoteRequestServer::reportMemoryUsage(qint64 residentSize)
+{
+    Q_D(RemoteRequestServer);
+    QVariantMap message;
+    message[residentSizeKey] = residentSize;
+    d->queueEvent(IpcHandler::MemoryUsage, 0, message);
 }
 
 #include "remote-request-interface.moc"
@@ -22,6 +22,7 @@
 #define SIGNON_UI_REMOTE_REQUEST_INTERFACE_H
 
 #include <QIODevice>
+#include <QUrl>
 #include <QVariantMap>
 
 namespace SignOnUi {
@@ -37,12 +38,22 @@ public:
 
     void setChannels(QIODevice *readChannel, QIODevice *writeChannel);
 
-    void start(const QVariantMap &parameters);
-    void cancel();
+    /* Several requests can run at the same time: each of them is
+     * identified by the id returned here. */
+    int start(const QVariantMap &parameters);
+    void cancel(int requestId);
+    int pendingRequests() const;
 
 Q_SIGNALS:
-    void result(const QVariantMap &result);
-    void canceled();
+    void result(int requestId, const QVariantMap &result);
+    void canceled(int requestId);
+    /* Progress of the running requests; these are delivered in batches */
+    void loadStarted(int requestId);
+    void loadProgress(int requestId, int progress);
+    void urlChanged(int requestId, const QUrl &url);
+    void loadFinished(int requestId, bool ok);
+    /* Resident memory of the server process, in kB */
+    void memoryUsage(qint64 residentSize);
 
 private:
     RemoteRequestClientPrivate *d_ptr;
@@ -60,12 +71,18 @@ public:
 
     void setChannels(QIODevice *readChannel, QIODevice *writeChannel);
 
-    void setResult(const QVariantMap &result);
-    void setCanceled();
+    void setResult(int requestId, const QVariantMap &result);
+    void setCanceled(int requestId);
+
+    void reportLoadStarted(int requestId);
+    void reportLoadProgress(int requestId, int progress);
+    void reportUrlChanged(int requestId, const QUrl &url);
+    void reportLoadFinished(int requestId, bool ok);
+    void reportMemoryUsage(qint64 residentSize);
 
 Q_SIGNALS:
-    void started(const QVariantMap &parameters);
-    void canceled();
+    void started(int requestId, const QVariantMap &parameters);
+    void canceled(int requestId);
 
 private:
     RemoteRequestServerPrivate *d_ptr;
@@ -25,6 +25,10 @@
 #ifdef USE_UBUNTU_WEB_VIEW
 #include "ubuntu-browser-request.h"
 #endif
+#ifdef USE_BROWSER_PROCESS
+#include "browser-process-pool.h"
+#include "remote-browser-request.h"
+#endif
 #include "browser-request.h"
 #include "debug.h"
 #include "dialog-request.h"
@@ -268,6 +272,14 @@ Request *Request::newRequest(const QDBusConnection &connection,
         if (QGuiApplication::platformName().startsWith("ubuntu") ||
             qgetenv("XDG_CURRENT_DESKTOP").startsWith("Unity") ||
             qgetenv("SSOUI_USE_UBUNTU_WEB_VIEW") == QByteArray("1")) {
+#ifdef USE_BROWSER_PROCESS
+            /* Use the web view in this process if the browser process
+             * cannot be started */
+            if (BrowserProcessPool::instance()->isAvailable()) {
+                return new RemoteBrowserRequest(connection, message,
+                                                parameters, parent);
+            }
+#endif
             return new UbuntuBrowserRequest(connection, message,
                                             parameters, parent);
         }
@@ -305,6 +317,8 @@ QString Request::id() const
 void Request::setWidget(QWidget *widget)
 {
     Q_D(Request);
+    /* The QWindow is only created along with the native window */
+    widget->winId();
     if (d->setWindow(widget->windowHandle())) {
         widget->show();
     }
@@ -367,6 +381,21 @@ const QVariantMap &Request::clientData() const
     return d->m_clientData;
 }
 
+bool Request::needsNetwork() const
+{
+    /* Requests which cannot be served while offline should reimplement this
+     * and return true; the Service will not start them until the network is
+     * available. */
+    return false;
+}
+
+void Request::prepare()
+{
+    /* Called as soon as the request is queued, possibly long before it's
+     * started: subclasses can reimplement this to perform any speculative
+     * work which will make start() faster. */
+}
+
 void Request::start()
 {
     Q_D(Request);
@@ -382,6 +411,14 @@ void Request::cancel()
     setCanceled();
 }
 
+void Request::setNetworkUnavailable()
+{
+    QVariantMap result;
+    result[SSOUI_KEY_ERROR] = SignOn::QUERY_ERROR_NOT_AVAILABLE;
+
+    setResult(result);
+}
+
 void Request::fail(const QString &name, const QString &message)
 {
     Q_D(Request);
@@ -53,12 +53,16 @@ public:
 
     bool isInProgress() const;
 
+    virtual bool needsNetwork() const;
+
     const QVariantMap &parameters() const;
     const QVariantMap &clientData() const;
 
 public Q_SLOTS:
+    virtual void prepare();
     virtual void start();
     void cancel();
+    void setNetworkUnavailable();
 
 Q_SIGNALS:
     void completed();
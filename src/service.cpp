@@ -20,8 +20,10 @@
 
 #include "service.h"
 
+#include "browser-request.h"
 #include "cookie-jar-manager.h"
 #include "debug.h"
+#include "network-monitor.h"
 #include "request.h"
 
 #include <QDBusArgument>
@@ -81,6 +83,7 @@ public:
 
 private Q_SLOTS:
     void onRequestCompleted();
+    void onOnlineStateChanged(bool isOnline);
 
 private:
     mutable Service *q_ptr;
@@ -94,6 +97,9 @@ ServicePrivate::ServicePrivate(Service *service):
     QObject(service),
     q_ptr(service)
 {
+    QObject::connect(NetworkMonitor::instance(),
+                     SIGNAL(onlineStateChanged(bool)),
+                     this, SLOT(onOnlineStateChanged(bool)));
 }
 
 ServicePrivate::~ServicePrivate()
@@ -112,10 +118,22 @@ RequestQueue &ServicePrivate::queueForWindowId(WId windowId)
 void ServicePrivate::enqueue(Request *request)
 {
     Q_Q(Service);
+
+    /* Don't even try loading web pages if we know that we are offline */
+    if (request->needsNetwork() && !NetworkMonitor::instance()->isOnline()) {
+        TRACE() << "Network not available, failing request" << request;
+        request->setNetworkUnavailable();
+        request->deleteLater();
+        return;
+    }
+
     bool wasIdle = q->isIdle();
 
     WId windowId = request->windowId();
 
+    /* Let the request do some work in advance, while it waits for its turn */
+    request->prepare();
+
     RequestQueue &queue = queueForWindowId(windowId);
     queue.enqueue(request);
 
@@ -137,7 +155,16 @@ void ServicePrivate::runQueue(RequestQueue &queue)
     }
 
     QObject::connect(request, SIGNAL(completed()),
-                     this, SLOT(onRequestCompleted()));
+                     this, SLOT(onRequestCompleted()),
+                     Qt::UniqueConnection);
+
+    /* The network went away after the request was queued: wait for it to
+     * come back. */
+    if (request->needsNetwork() && !NetworkMonitor::instance()->isOnline()) {
+        TRACE() << "Waiting for the network";
+        return;
+    }
+
     request->start();
 }
 
@@ -169,6 +196,17 @@ void ServicePrivate::onRequestCompleted()
     }
 }
 
+void ServicePrivate::onOnlineStateChanged(bool isOnline)
+{
+    if (!isOnline) return;
+
+    /* Start the requests which were waiting for the network */
+    foreach (WId windowId, m_requests.keys()) {
+        if (!m_requests.contains(windowId)) continue;
+        runQueue(m_requests[windowId]);
+    }
+}
+
 void ServicePrivate::cancelUiRequest(const QString &requestId)
 {
     Request *request = 0;
@@ -196,6 +234,8 @@ void ServicePrivate::removeIdentityData(quint32 id)
 
     /* The BrowserRequest class uses CookieJarManager to store the cookies */
     CookieJarManager::instance()->removeForIdentity(id);
+    /* ...and the web storage, also used by the UbuntuBrowserRequest */
+    BrowserRequest::removeIdentityData(id);
 }
 
 Service::Service(QObject *parent):
@@ -31,6 +31,7 @@ lessThan(QT_MAJOR_VERSION, 5) {
         x11
 } else {
     QT += \
+        concurrent \
         webkitwidgets \
         widgets
     PKGCONFIG += \
@@ -43,9 +44,11 @@ lessThan(QT_MAJOR_VERSION, 5) {
 
 HEADERS = \
     animation-label.h \
+    browser-network-access-manager.h \
     browser-request.h \
     cookie-jar-manager.h \
     debug.h \
+    dialog-pool.h \
     dialog-request.h \
     dialog.h \
     errors.h \
@@ -53,7 +56,11 @@ HEADERS = \
     i18n.h \
     inactivity-timer.h \
     indicator-service.h \
+    load-retry-policy.h \
     network-access-manager.h \
+    network-cache.h \
+    network-monitor.h \
+    process-memory.h \
     reauthenticator.h \
     request.h \
     service.h \
@@ -61,18 +68,24 @@ HEADERS = \
 
 SOURCES = \
     animation-label.cpp \
+    browser-network-access-manager.cpp \
     browser-request.cpp \
     cookie-jar-manager.cpp \
     debug.cpp \
+    dialog-pool.cpp \
     dialog-request.cpp \
     dialog.cpp \
     http-warning.cpp \
     i18n.cpp \
     inactivity-timer.cpp \
     indicator-service.cpp \
+    load-retry-policy.cpp \
     main.cpp \
     my-network-proxy-factory.cpp \
     network-access-manager.cpp \
+    network-cache.cpp \
+    network-monitor.cpp \
+    process-memory.cpp \
     reauthenticator.cpp \
     request.cpp \
     service.cpp \
@@ -111,6 +124,23 @@ CONFIG(use-ubuntu-web-view) {
     COMMANDLINE += " --desktop_file_hint=$${INSTALL_PREFIX}/share/applications/signon-ui.desktop"
 }
 
+# The browser process runs the same web view as use-ubuntu-web-view
+CONFIG(use-ubuntu-web-view):CONFIG(use-browser-process) {
+    DEFINES += \
+        USE_BROWSER_PROCESS \
+        BROWSER_PROCESS_PATH=\\\"$${LIBEXECDIR}/signon-ui/browser-process\\\"
+    HEADERS += \
+        browser-process-pool.h \
+        remote-browser-request.h \
+        remote-request-interface.h \
+        unix-socket-channel.h
+    SOURCES += \
+        browser-process-pool.cpp \
+        remote-browser-request.cpp \
+        remote-request-interface.cpp \
+        unix-socket-channel.cpp
+}
+
 DEFINES += \
     DEBUG_ENABLED \
     I18N_DOMAIN=\\\"$${I18N_DOMAIN}\\\"
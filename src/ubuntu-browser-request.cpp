@@ -24,11 +24,11 @@
 #include "qquick-dialog.h"
 #include "errors.h"
 #include "i18n.h"
+#include "load-retry-policy.h"
 
 #include <QDir>
 #include <QQmlContext>
 #include <QStandardPaths>
-#include <QTimer>
 #include <SignOn/uisessiondata_priv.h>
 
 using namespace SignOnUi;
@@ -61,10 +61,15 @@ public:
 public Q_SLOTS:
     void cancel();
     void onLoadStarted();
+    void onLoadProgress(int progress);
     void onLoadFinished(bool ok);
 
+Q_SIGNALS:
+    void reloadRequested();
+    void stopRequested();
+
 private Q_SLOTS:
-    void onFailTimer();
+    void onLoadFailure();
     void onFinished();
 
 private:
@@ -76,7 +81,7 @@ private:
     QUrl m_startUrl;
     QUrl m_finalUrl;
     QUrl m_responseUrl;
-    QTimer m_failTimer;
+    LoadRetryPolicy m_retryPolicy;
     mutable UbuntuBrowserRequest *q_ptr;
 };
 
@@ -88,10 +93,12 @@ UbuntuBrowserRequestPrivate::UbuntuBrowserRequestPrivate(
     m_dialog(0),
     q_ptr(request)
 {
-    m_failTimer.setSingleShot(true);
-    m_failTimer.setInterval(3000);
-    QObject::connect(&m_failTimer, SIGNAL(timeout()),
-                     this, SLOT(onFailTimer()));
+    QObject::connect(&m_retryPolicy, SIGNAL(retry()),
+                     this, SIGNAL(reloadRequested()));
+    QObject::connect(&m_retryPolicy, SIGNAL(abortLoad()),
+                     this, SIGNAL(stopRequested()));
+    QObject::connect(&m_retryPolicy, SIGNAL(failed()),
+                     this, SLOT(onLoadFailure()));
 }
 
 UbuntuBrowserRequestPrivate::~UbuntuBrowserRequestPrivate()
@@ -156,7 +163,7 @@ QUrl UbuntuBrowserRequestPrivate::pageComponentUrl() const
 void UbuntuBrowserRequestPrivate::setCurrentUrl(const QUrl &url)
 {
     TRACE() << "Url changed:" << url;
-    m_failTimer.stop();
+    m_retryPolicy.loadProgressed();
 
     if (url.host() == m_finalUrl.host() &&
         url.path() == m_finalUrl.path()) {
@@ -185,7 +192,15 @@ void UbuntuBrowserRequestPrivate::cancel()
 
 void UbuntuBrowserRequestPrivate::onLoadStarted()
 {
-    m_failTimer.stop();
+    QUrl url = m_currentUrl.isEmpty() ? m_startUrl : m_currentUrl;
+    m_retryPolicy.loadStarted(url.host());
+}
+
+void UbuntuBrowserRequestPrivate::onLoadProgress(int progress)
+{
+    Q_UNUSED(progress);
+    /* Slow pages which are still making progress are not timed out */
+    m_retryPolicy.loadProgressed();
 }
 
 void UbuntuBrowserRequestPrivate::onLoadFinished(bool ok)
@@ -195,9 +210,11 @@ void UbuntuBrowserRequestPrivate::onLoadFinished(bool ok)
     TRACE() << "Load finished" << ok;
 
     if (!ok) {
-        m_failTimer.start();
+        /* The QML WebView doesn't tell us the reason of the failure */
+        m_retryPolicy.loadFailed();
         return;
     }
+    m_retryPolicy.loadSucceeded();
 
     if (!m_dialog->isVisible()) {
         if (m_responseUrl.isEmpty()) {
@@ -208,7 +225,7 @@ void UbuntuBrowserRequestPrivate::onLoadFinished(bool ok)
     }
 }
 
-void UbuntuBrowserRequestPrivate::onFailTimer()
+void UbuntuBrowserRequestPrivate::onLoadFailure()
 {
     Q_Q(UbuntuBrowserRequest);
 
@@ -224,6 +241,7 @@ void UbuntuBrowserRequestPrivate::onFinished()
     Q_Q(UbuntuBrowserRequest);
 
     TRACE() << "Browser dialog closed";
+    m_retryPolicy.cancel();
     QObject::disconnect(m_dialog, SIGNAL(finished(int)),
                         this, SLOT(onFinished()));
 
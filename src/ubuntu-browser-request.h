@@ -41,6 +41,7 @@ public:
     ~UbuntuBrowserRequest();
 
     // reimplemented virtual methods
+    bool needsNetwork() const { return true; }
     void start();
 
 private:
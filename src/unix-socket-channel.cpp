@@ -0,0 +1,296 @@
+/*
+ * This file is part of signon-ui
+ *
+ * Copyright (C) 2014 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "unix-socket-channel.h"
+
+#include "debug.h"
+
+#include <QSocketNotifier>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace SignOnUi;
+
+static const int readChunkSize = 64 * 1024;
+/* Descriptors which can be received with a single message */
+static const int maxDescriptors = 16;
+
+UnixSocketChannel::UnixSocketChannel(QObject *parent):
+    QIODevice(parent),
+    m_fd(-1),
+    m_readNotifier(0),
+    m_writeNotifier(0),
+    m_inputPos(0),
+    m_outputPos(0)
+{
+    /* Reserving the capacity makes resize() never release it */
+    m_input.reserve(readChunkSize);
+}
+
+UnixSocketChannel::~UnixSocketChannel()
+{
+    closeSocket();
+}
+
+bool UnixSocketChannel::setSocketDescriptor(int fd)
+{
+    if (m_fd >= 0 || fd < 0) return false;
+
+    m_fd = fd;
+    m_readNotifier = new QSocketNotifier(m_fd, QSocketNotifier::Read, this);
+    QObject::connect(m_readNotifier, SIGNAL(activated(int)),
+                     this, SLOT(onReadable()));
+    m_writeNotifier = new QSocketNotifier(m_fd, QSocketNotifier::Write, this);
+    m_writeNotifier->setEnabled(false);
+    QObject::connect(m_writeNotifier, SIGNAL(activated(int)),
+                     this, SLOT(onWritable()));
+
+    return open(QIODevice::ReadWrite);
+}
+
+void UnixSocketChannel::queueDescriptor(int fd)
+{
+    m_outgoingDescriptors.append(qMakePair(qint64(m_output.size() -
+                                                  m_outputPos), fd));
+}
+
+int UnixSocketChannel::takeDescriptor()
+{
+    if (m_incomingDescriptors.isEmpty()) return -1;
+    return m_incomingDescriptors.dequeue();
+}
+
+bool UnixSocketChannel::isSequential() const
+{
+    return true;
+}
+
+qint64 UnixSocketChannel::bytesAvailable() const
+{
+    return m_input.size() - m_inputPos + QIODevice::bytesAvailable();
+}
+
+qint64 UnixSocketChannel::bytesToWrite() const
+{
+    return m_output.size() - m_outputPos;
+}
+
+void UnixSocketChannel::close()
+{
+    QIODevice::close();
+    closeSocket();
+}
+
+qint64 UnixSocketChannel::readData(char *data, qint64 maxSize)
+{
+    qint64 available = m_input.size() - m_inputPos;
+    if (available == 0) {
+        return (m_fd < 0) ? -1 : 0;
+    }
+
+    qint64 size = qMin(maxSize, available);
+    memcpy(data, m_input.constData() + m_inputPos, size);
+    m_inputPos += size;
+    if (m_inputPos == m_input.size()) {
+        m_input.resize(0);
+        m_inputPos = 0;
+    }
+    return size;
+}
+
+qint64 UnixSocketChannel::writeData(const char *data, qint64 size)
+{
+    if (m_fd < 0) return -1;
+
+    m_output.append(data, size);
+    flushOutput();
+    return size;
+}
+
+void UnixSocketChannel::onReadable()
+{
+    bool gotData = false;
+    while (m_fd >= 0) {
+        /* Drop the data which has been read already, but only once it takes
+         * most of the buffer: moving the unread data on every read would make
+         * the cost quadratic */
+        if (m_inputPos > 0 && m_inputPos >= m_input.size() / 2) {
+            m_input.remove(0, m_inputPos);
+            m_inputPos = 0;
+        }
+        int oldSize = m_input.size();
+        m_input.resize(oldSize + readChunkSize);
+
+        struct iovec iov;
+        iov.iov_base = m_input.data() + oldSize;
+        iov.iov_len = readChunkSize;
+        char control[CMSG_SPACE(sizeof(int) * maxDescriptors)];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t received = recvmsg(m_fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        m_input.resize(oldSize + qMax(received, ssize_t(0)));
+        if (received < 0 && errno == EINTR) continue;
+
+        /* The control buffer is left untouched on errors */
+        if (received < 0) msg.msg_controllen = 0;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != 0;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET ||
+                cmsg->cmsg_type != SCM_RIGHTS) continue;
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int *fds = (const int *)CMSG_DATA(cmsg);
+            for (int i = 0; i < count; i++) {
+                m_incomingDescriptors.enqueue(fds[i]);
+            }
+        }
+        if (msg.msg_flags & MSG_CTRUNC) {
+            BLAME() << "Some descriptors were lost";
+        }
+
+        if (received > 0) {
+            gotData = true;
+            if (received < readChunkSize) break;
+        } else if (received < 0 && errno == EAGAIN) {
+            break;
+        } else {
+            /* End of file, or error */
+            TRACE() << "Socket closed:" << (received < 0 ? errno : 0);
+            closeSocket();
+            Q_EMIT readChannelFinished();
+            Q_EMIT disconnected();
+        }
+    }
+
+    if (gotData) {
+        Q_EMIT readyRead();
+    }
+}
+
+void UnixSocketChannel::onWritable()
+{
+    flushOutput();
+}
+
+void UnixSocketChannel::flushOutput()
+{
+    while (m_fd >= 0 && m_outputPos < m_output.size()) {
+        /* Descriptors are attached to the first byte they were queued
+         * before; never send data past the next descriptor */
+        qint64 size = m_output.size() - m_outputPos;
+        int fdCount = 0;
+        int fds[maxDescriptors];
+        for (int i = 0; i < m_outgoingDescriptors.count(); i++) {
+            const QPair<qint64,int> &pending = m_outgoingDescriptors[i];
+            if (pending.first == 0 && fdCount < maxDescriptors) {
+                fds[fdCount++] = pending.second;
+            } else {
+                size = qMin(size, qMax(pending.first, qint64(1)));
+                break;
+            }
+        }
+
+        struct iovec iov;
+        iov.iov_base = m_output.data() + m_outputPos;
+        iov.iov_len = size;
+        char control[CMSG_SPACE(sizeof(int) * maxDescriptors)];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if (fdCount > 0) {
+            memset(control, 0, sizeof(control));
+            msg.msg_control = control;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * fdCount);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fdCount);
+            memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fdCount);
+        }
+
+        ssize_t sent = sendmsg(m_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) {
+                m_writeNotifier->setEnabled(true);
+                return;
+            }
+            BLAME() << "Write error:" << strerror(errno);
+            closeSocket();
+            Q_EMIT disconnected();
+            return;
+        }
+
+        /* The receiver has its own copy of the descriptors now */
+        for (int i = 0; i < fdCount; i++) {
+            ::close(m_outgoingDescriptors.takeFirst().second);
+        }
+        for (int i = 0; i < m_outgoingDescriptors.count(); i++) {
+            m_outgoingDescriptors[i].first -= sent;
+        }
+        /* As for the input, move the unsent data only when most of the
+         * buffer has been sent */
+        m_outputPos += sent;
+        if (m_outputPos == m_output.size()) {
+            m_output.resize(0);
+            m_outputPos = 0;
+        } else if (m_outputPos >= m_output.size() / 2) {
+            m_output.remove(0, m_outputPos);
+            m_outputPos = 0;
+        }
+        Q_EMIT bytesWritten(sent);
+    }
+
+    if (m_writeNotifier != 0) {
+        m_writeNotifier->setEnabled(false);
+    }
+}
+
+void UnixSocketChannel::closeSocket()
+{
+    if (m_fd < 0) return;
+
+    /* This can be called from the notifiers' own slots */
+    m_readNotifier->setEnabled(false);
+    m_readNotifier->deleteLater();
+    m_readNotifier = 0;
+    m_writeNotifier->setEnabled(false);
+    m_writeNotifier->deleteLater();
+    m_writeNotifier = 0;
+    ::close(m_fd);
+    m_fd = -1;
+
+    for (int i = 0; i < m_outgoingDescriptors.count(); i++) {
+        ::close(m_outgoingDescriptors[i].second);
+    }
+    m_outgoingDescriptors.clear();
+    while (!m_incomingDescriptors.isEmpty()) {
+        ::close(m_incomingDescriptors.dequeue());
+    }
+    m_output.clear();
+    m_outputPos = 0;
+}
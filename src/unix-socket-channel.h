@@ -0,0 +1,92 @@
+/*
+ * This file is part of signon-ui
+ *
+ * Copyright (C) 2014 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIGNON_UI_UNIX_SOCKET_CHANNEL_H
+#define SIGNON_UI_UNIX_SOCKET_CHANNEL_H
+
+#include <QByteArray>
+#include <QIODevice>
+#include <QList>
+#include <QPair>
+#include <QQueue>
+
+class QSocketNotifier;
+
+namespace SignOnUi {
+
+/* A QIODevice over a connected AF_UNIX stream socket, which can also carry
+ * file descriptors along with the data. */
+class UnixSocketChannel: public QIODevice
+{
+    Q_OBJECT
+
+public:
+    explicit UnixSocketChannel(QObject *parent = 0);
+    ~UnixSocketChannel();
+
+    /* Takes ownership of the socket, and opens the device */
+    bool setSocketDescriptor(int fd);
+    int socketDescriptor() const { return m_fd; }
+
+    /* The descriptor is sent along with the next byte written, and then
+     * closed */
+    void queueDescriptor(int fd);
+    /* Returns the received descriptors in the order they were sent, or -1;
+     * the caller must close them */
+    int takeDescriptor();
+
+    // reimplemented virtual methods
+    bool isSequential() const;
+    qint64 bytesAvailable() const;
+    qint64 bytesToWrite() const;
+    void close();
+
+Q_SIGNALS:
+    void disconnected();
+
+protected:
+    // reimplemented virtual methods
+    qint64 readData(char *data, qint64 maxSize);
+    qint64 writeData(const char *data, qint64 size);
+
+private Q_SLOTS:
+    void onReadable();
+    void onWritable();
+
+private:
+    void flushOutput();
+    void closeSocket();
+
+private:
+    int m_fd;
+    QSocketNotifier *m_readNotifier;
+    QSocketNotifier *m_writeNotifier;
+    QByteArray m_input;
+    int m_inputPos;
+    QByteArray m_output;
+    int m_outputPos;
+    /* Offset in the unsent output, descriptor */
+    QList<QPair<qint64,int> > m_outgoingDescriptors;
+    QQueue<int> m_incomingDescriptors;
+};
+
+} // namespace
+
+#endif // SIGNON_UI_UNIX_SOCKET_CHANNEL_H
@@ -0,0 +1,124 @@
+/*
+ * This file is part of signon-ui
+ *
+ * Copyright (C) 2014 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fake-http-server.h"
+
+#include <QTcpSocket>
+#include <QTimer>
+
+FakeHttpServer::FakeHttpServer(QObject *parent):
+    QTcpServer(parent),
+    m_delay(0),
+    m_requestCount(0),
+    m_bytesSent(0)
+{
+    QObject::connect(this, SIGNAL(newConnection()),
+                     this, SLOT(onNewConnection()));
+    listen(QHostAddress::LocalHost);
+}
+
+FakeHttpServer::~FakeHttpServer()
+{
+}
+
+void FakeHttpServer::setReply(const QString &path, const QByteArray &body,
+                              const QByteArray &headers)
+{
+    QByteArray reply("HTTP/1.1 200 OK\r\n");
+    reply += "Content-Length: " + QByteArray::number(body.size()) + "\r\n";
+    reply += headers;
+    reply += "\r\n";
+    reply += body;
+    m_replies.insert(path, reply);
+}
+
+void FakeHttpServer::setRedirect(const QString &path, const QString &location)
+{
+    QByteArray reply("HTTP/1.1 302 Found\r\n");
+    reply += "Location: " + location.toUtf8() + "\r\n";
+    reply += "Content-Length: 0\r\n";
+    reply += "\r\n";
+    m_replies.insert(path, reply);
+}
+
+QUrl FakeHttpServer::url(const QString &path) const
+{
+    return QUrl(QString::fromLatin1("http://localhost:%1%2").
+                arg(serverPort()).arg(path));
+}
+
+void FakeHttpServer::onNewConnection()
+{
+    while (hasPendingConnections()) {
+        QTcpSocket *socket = nextPendingConnection();
+        QObject::connect(socket, SIGNAL(readyRead()),
+                         this, SLOT(onReadyRead()));
+        QObject::connect(socket, SIGNAL(disconnected()),
+                         socket, SLOT(deleteLater()));
+    }
+}
+
+void FakeHttpServer::onReadyRead()
+{
+    QTcpSocket *socket = qobject_cast<QTcpSocket*>(sender());
+    if (socket == 0) return;
+
+    /* We only handle GET requests, and wait until all headers are there */
+    QByteArray buffer = socket->property("buffer").toByteArray();
+    buffer += socket->readAll();
+    int end = buffer.indexOf("\r\n\r\n");
+    if (end < 0) {
+        socket->setProperty("buffer", buffer);
+        return;
+    }
+    socket->setProperty("buffer", buffer.mid(end + 4));
+    m_lastRequest = buffer.left(end);
+
+    QList<QByteArray> requestLine = buffer.left(buffer.indexOf("\r\n")).
+        split(' ');
+    QString path = requestLine.count() > 1 ?
+        QString::fromLatin1(requestLine[1]) : QString();
+    m_requestCount++;
+
+    if (m_delay > 0) {
+        m_pendingReplies.append(PendingReply(socket, path));
+        QTimer::singleShot(m_delay, this, SLOT(onDelayElapsed()));
+    } else {
+        reply(socket, path);
+    }
+}
+
+void FakeHttpServer::onDelayElapsed()
+{
+    if (m_pendingReplies.isEmpty()) return;
+
+    PendingReply pending = m_pendingReplies.takeFirst();
+    if (pending.first != 0) {
+        reply(pending.first, pending.second);
+    }
+}
+
+void FakeHttpServer::reply(QTcpSocket *socket, const QString &path)
+{
+    QByteArray data = m_replies.value(path,
+        "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+    m_bytesSent += data.size();
+    socket->write(data);
+}
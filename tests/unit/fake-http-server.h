@@ -0,0 +1,72 @@
+/*
+ * This file is part of signon-ui
+ *
+ * Copyright (C) 2014 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIGNON_UI_FAKE_HTTP_SERVER_H
+#define SIGNON_UI_FAKE_HTTP_SERVER_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QPair>
+#include <QPointer>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QUrl>
+
+/* A minimal HTTP server, serving static replies from localhost. */
+class FakeHttpServer: public QTcpServer
+{
+    Q_OBJECT
+
+public:
+    FakeHttpServer(QObject *parent = 0);
+    ~FakeHttpServer();
+
+    void setReply(const QString &path, const QByteArray &body,
+                  const QByteArray &headers = QByteArray());
+    void setRedirect(const QString &path, const QString &location);
+    /* Delay the replies by the given number of milliseconds */
+    void setDelay(int delay) { m_delay = delay; }
+
+    QUrl url(const QString &path) const;
+    int requestCount() const { return m_requestCount; }
+    /* The request line and headers of the last request received */
+    QByteArray lastRequest() const { return m_lastRequest; }
+    qint64 bytesSent() const { return m_bytesSent; }
+
+private Q_SLOTS:
+    void onNewConnection();
+    void onReadyRead();
+    void onDelayElapsed();
+
+private:
+    void reply(QTcpSocket *socket, const QString &path);
+
+private:
+    typedef QPair<QPointer<QTcpSocket>,QString> PendingReply;
+    QHash<QString,QByteArray> m_replies;
+    QList<PendingReply> m_pendingReplies;
+    QByteArray m_lastRequest;
+    int m_delay;
+    int m_requestCount;
+    qint64 m_bytesSent;
+};
+
+#endif // SIGNON_UI_FAKE_HTTP_SERVER_H
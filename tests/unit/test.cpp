@@ -18,18 +18,36 @@
  * with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "browser-network-access-manager.h"
+#include "cookie-jar-manager.h"
 #include "debug.h"
+#include "dialog-pool.h"
+#include "fake-http-server.h"
 #include "fake-libnotify.h"
 #include "indicator-service.h"
+#include "network-cache.h"
 #include "test.h"
 #include "reauthenticator.h"
 #include "request.h"
 #include "fake-webcredentials-interface.h"
 
 #include <Accounts/Manager>
+#include <QApplication>
+#include <QBuffer>
 #include <QDebug>
 #include <QDir>
+#include <QElapsedTimer>
+#include <QImage>
+#include <QLabel>
+#include <QLineEdit>
+#include <QNetworkCookie>
+#include <QNetworkCookieJar>
+#include <QNetworkReply>
+#include <QNetworkRequest>
+#include <QPointer>
 #include <QSignalSpy>
+#include <QStandardPaths>
+#include <QTemporaryDir>
 #include <SignOn/uisessiondata.h>
 #include <SignOn/uisessiondata_priv.h>
 
@@ -48,6 +66,9 @@ void SignOnUiTest::initTestCase()
     QDir dbroot("/tmp");
     dbroot.remove("accounts.db");
 
+    /* Don't touch the user's cache directory */
+    QStandardPaths::setTestModeEnabled(true);
+    QDir(NetworkCache::cacheDirectory()).removeRecursively();
 }
 
 void SignOnUiTest::testRequestObjects()
@@ -144,6 +165,476 @@ void SignOnUiTest::testRequestWithIndicator()
     delete manager;
 }
 
+void SignOnUiTest::testResourceFilter()
+{
+    BrowserNetworkAccessManager nam;
+    QVERIFY(!nam.isBlocked(QUrl("https://tracker.example.com/pixel.gif")));
+
+    nam.setBlockedResourcesPattern("tracker\\.example\\.com/.*");
+    nam.setAllowedResourcesPattern("tracker\\.example\\.com/login/.*");
+    QVERIFY(nam.isBlocked(QUrl("https://tracker.example.com/pixel.gif")));
+    QVERIFY(nam.isBlocked(QUrl("http://tracker.example.com/a/b.js?c=d")));
+    QVERIFY(!nam.isBlocked(QUrl("https://tracker.example.com/login/form.js")));
+    QVERIFY(!nam.isBlocked(QUrl("https://www.example.com/")));
+
+    /* Blocked requests must fail without touching the network */
+    QNetworkReply *reply =
+        nam.get(QNetworkRequest(QUrl("https://tracker.example.com/pixel.gif")));
+    QVERIFY(reply != 0);
+    QSignalSpy finished(reply, SIGNAL(finished()));
+    QVERIFY(finished.wait(1000));
+    QCOMPARE(reply->error(), QNetworkReply::ContentAccessDenied);
+    QCOMPARE(reply->readAll(), QByteArray());
+    delete reply;
+
+    QByteArray body("some tracking data");
+    QNetworkRequest request(QUrl("https://tracker.example.com/collect"));
+    request.setHeader(QNetworkRequest::ContentTypeHeader, "text/plain");
+    reply = nam.post(request, body);
+    QSignalSpy finished2(reply, SIGNAL(finished()));
+    QVERIFY(finished2.wait(1000));
+    delete reply;
+
+    BrowserNetworkAccessManager::Statistics stats = nam.statistics();
+    QCOMPARE(stats.blockedRequests, 2);
+    QCOMPARE(stats.blockedBytes, qint64(body.size()));
+}
+
+static QByteArray download(QNetworkAccessManager *nam, const QUrl &url)
+{
+    QNetworkReply *reply = nam->get(QNetworkRequest(url));
+    QSignalSpy finished(reply, SIGNAL(finished()));
+    if (!reply->isFinished()) finished.wait(3000);
+    QByteArray data = reply->readAll();
+    delete reply;
+    return data;
+}
+
+void SignOnUiTest::testNetworkCache()
+{
+    FakeHttpServer server;
+    QByteArray style(20000, 'x');
+    server.setReply("/style.css", style,
+                    "Content-Type: text/css\r\n"
+                    "Cache-Control: max-age=3600\r\n");
+    server.setReply("/personal.css", style,
+                    "Content-Type: text/css\r\n"
+                    "Cache-Control: max-age=3600\r\n"
+                    "Set-Cookie: session=1234\r\n");
+
+    /* First login: everything comes from the network */
+    BrowserNetworkAccessManager *nam = new BrowserNetworkAccessManager;
+    QCOMPARE(download(nam, server.url("/style.css")), style);
+    QCOMPARE(download(nam, server.url("/personal.css")), style);
+    BrowserNetworkAccessManager::Statistics stats = nam->statistics();
+    QCOMPARE(stats.networkBytes, qint64(2 * style.size()));
+    QCOMPARE(stats.cacheBytes, qint64(0));
+    QCOMPARE(server.requestCount(), 2);
+    delete nam;
+
+    /* Repeated login, with a new manager: the static asset must come from
+     * the shared cache, while the reply setting cookies must not have been
+     * cached. */
+    nam = new BrowserNetworkAccessManager;
+    QCOMPARE(download(nam, server.url("/style.css")), style);
+    QCOMPARE(download(nam, server.url("/personal.css")), style);
+    stats = nam->statistics();
+    QCOMPARE(stats.networkBytes, qint64(style.size()));
+    QCOMPARE(stats.cacheBytes, qint64(style.size()));
+    QCOMPARE(server.requestCount(), 3);
+    /* The cached asset was sent only once */
+    QVERIFY(server.bytesSent() >= 3 * style.size());
+    QVERIFY(server.bytesSent() < 4 * style.size());
+    delete nam;
+}
+
+void SignOnUiTest::testNetworkCacheWithCookies()
+{
+    FakeHttpServer server;
+    QByteArray logo(20000, 'l');
+    server.setReply("/logo.png", logo,
+                    "Content-Type: image/png\r\n"
+                    "Cache-Control: max-age=3600\r\n");
+    /* A personalized reply which the server forgot to mark as private */
+    server.setReply("/account.css", logo,
+                    "Content-Type: text/css\r\n"
+                    "Cache-Control: max-age=3600\r\n");
+    server.setReply("/token.css", logo,
+                    "Content-Type: text/css\r\n"
+                    "Cache-Control: max-age=3600\r\n");
+
+    /* A logged-in page: every request carries the session cookie */
+    QList<QNetworkCookie> cookies;
+    cookies.append(QNetworkCookie("session", "1234"));
+    BrowserNetworkAccessManager *nam = new BrowserNetworkAccessManager;
+    nam->cookieJar()->setCookiesFromUrl(cookies, server.url("/"));
+    QCOMPARE(download(nam, server.url("/account.css")), logo);
+    QVERIFY(server.lastRequest().contains("session=1234"));
+    delete nam;
+
+    /* Neither a request carrying cookies, nor one carrying an authorization
+     * header, must fill the shared cache */
+    nam = new BrowserNetworkAccessManager;
+    QNetworkRequest request(server.url("/token.css"));
+    request.setRawHeader("Authorization", "Bearer 1234");
+    QNetworkReply *reply = nam->get(request);
+    QSignalSpy finished(reply, SIGNAL(finished()));
+    QVERIFY(finished.wait(3000));
+    QCOMPARE(reply->readAll(), logo);
+    delete reply;
+    QCOMPARE(download(nam, server.url("/logo.png")), logo);
+    QCOMPARE(server.requestCount(), 3);
+    delete nam;
+
+    /* Another identity must get the personal replies from the network, while
+     * the anonymous asset can come from the cache even with cookies */
+    nam = new BrowserNetworkAccessManager;
+    nam->cookieJar()->setCookiesFromUrl(cookies, server.url("/"));
+    QCOMPARE(download(nam, server.url("/logo.png")), logo);
+    QCOMPARE(download(nam, server.url("/account.css")), logo);
+    QCOMPARE(download(nam, server.url("/token.css")), logo);
+    BrowserNetworkAccessManager::Statistics stats = nam->statistics();
+    QCOMPARE(stats.cacheBytes, qint64(logo.size()));
+    QCOMPARE(stats.networkBytes, qint64(2 * logo.size()));
+    QCOMPARE(server.requestCount(), 5);
+    delete nam;
+}
+
+void SignOnUiTest::testCookieRouting()
+{
+    FakeHttpServer server;
+    server.setReply("/login", "ok", "Set-Cookie: session=first\r\n");
+    server.setReply("/page", "ok");
+
+    /* Two browser pages, for two different identities */
+    const uint firstId = 9001;
+    const uint secondId = 9002;
+    BrowserNetworkAccessManager *first =
+        BrowserNetworkAccessManager::acquire(firstId);
+    BrowserNetworkAccessManager *second =
+        BrowserNetworkAccessManager::acquire(secondId);
+    QVERIFY(first != second);
+    CookieJarManager *cookieJarManager = CookieJarManager::instance();
+    QCOMPARE(first->cookieJar(),
+             (QNetworkCookieJar *)cookieJarManager->cookieJarForIdentity(firstId));
+    QCOMPARE(second->cookieJar(),
+             (QNetworkCookieJar *)cookieJarManager->cookieJarForIdentity(secondId));
+
+    QCOMPARE(download(first, server.url("/login")), QByteArray("ok"));
+
+    /* The cookie must only be sent on behalf of the first identity */
+    download(second, server.url("/page"));
+    QVERIFY(!server.lastRequest().contains("session=first"));
+    download(first, server.url("/page"));
+    QVERIFY(server.lastRequest().contains("session=first"));
+
+    /* A concurrent page of the same identity gets a manager of its own, with
+     * the same cookies */
+    BrowserNetworkAccessManager *concurrent =
+        BrowserNetworkAccessManager::acquire(firstId);
+    QVERIFY(concurrent != first);
+    QCOMPARE(concurrent->cookieJar(), first->cookieJar());
+    BrowserNetworkAccessManager::release(concurrent);
+
+    /* The next page of the identity reuses its manager, and its connections,
+     * without any state of the previous page */
+    first->setFinalUrl(server.url("/final"));
+    BrowserNetworkAccessManager::release(first);
+    BrowserNetworkAccessManager *next =
+        BrowserNetworkAccessManager::acquire(firstId);
+    QCOMPARE(next, first);
+    QVERIFY(!next->isFinalUrl(server.url("/final")));
+    QCOMPARE(next->statistics().networkBytes, qint64(0));
+    BrowserNetworkAccessManager::release(next);
+    BrowserNetworkAccessManager::release(second);
+
+    BrowserNetworkAccessManager::removeForIdentity(firstId);
+    BrowserNetworkAccessManager::removeForIdentity(secondId);
+}
+
+void SignOnUiTest::testFinalUrlRedirect()
+{
+    FakeHttpServer server;
+    server.setRedirect("/authorize", server.url("/final?code=1234").toString());
+    server.setReply("/final", "should not be loaded");
+    server.setReply("/slow.js", "var x;");
+
+    BrowserNetworkAccessManager nam;
+    nam.setFinalUrl(server.url("/final/"));
+    QVERIFY(nam.isFinalUrl(server.url("/final?code=1234")));
+    QVERIFY(!nam.isFinalUrl(server.url("/authorize")));
+    QUrl otherPort = server.url("/final");
+    otherPort.setPort(otherPort.port() + 1);
+    QVERIFY(!nam.isFinalUrl(otherPort));
+    QUrl otherScheme = server.url("/final");
+    otherScheme.setScheme("https");
+    QVERIFY(!nam.isFinalUrl(otherScheme));
+    QSignalSpy finalUrlReached(&nam, SIGNAL(finalUrlReached(const QUrl&)));
+
+    /* A resource which happens to have the final URL is just loaded */
+    QNetworkReply *resource = nam.get(QNetworkRequest(server.url("/final")));
+    QSignalSpy resourceFinished(resource, SIGNAL(finished()));
+    QVERIFY(resourceFinished.wait(3000));
+    QCOMPARE(resource->readAll(), QByteArray("should not be loaded"));
+    QCOMPARE(finalUrlReached.count(), 0);
+    delete resource;
+
+    /* A resource which is still loading when the redirection arrives */
+    server.setDelay(500);
+    QNetworkReply *pending = nam.get(QNetworkRequest(server.url("/slow.js")));
+    QTest::qWait(50);
+    server.setDelay(0);
+
+    nam.expectNavigation(server.url("/authorize#top"));
+    QNetworkReply *reply = nam.get(QNetworkRequest(server.url("/authorize")));
+    QSignalSpy finished(reply, SIGNAL(finished()));
+    QVERIFY(finished.wait(3000));
+    QCOMPARE(finalUrlReached.count(), 1);
+    QCOMPARE(finalUrlReached.at(0).at(0).toUrl(),
+             server.url("/final?code=1234"));
+
+    /* The final URL must not be requested, and pending loads are aborted */
+    QVERIFY(pending->isFinished());
+    QCOMPARE(pending->error(), QNetworkReply::OperationCanceledError);
+    QCOMPARE(server.requestCount(), 3);
+    delete pending;
+    delete reply;
+}
+
+void SignOnUiTest::testCookieMerge()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    CookieJar jar(dir.path() + "/test.jar");
+    QUrl url("http://www.example.com/");
+
+    QList<QNetworkCookie> session =
+        QNetworkCookie::parseCookies("session=1; domain=.example.com; path=/");
+    QList<QNetworkCookie> prefs =
+        QNetworkCookie::parseCookies("prefs=dark; domain=.example.com; path=/");
+    QCOMPARE(jar.mergeCookies(session), 1);
+    /* Injecting the same cookies again must not change anything */
+    QCOMPARE(jar.mergeCookies(session), 0);
+
+    /* Cookies are replaced by name, domain and path; others are kept */
+    QCOMPARE(jar.mergeCookies(prefs), 1);
+    QList<QNetworkCookie> newSession =
+        QNetworkCookie::parseCookies("session=2; domain=.example.com; path=/");
+    QCOMPARE(jar.mergeCookies(newSession + prefs), 1);
+
+    QList<QNetworkCookie> cookies = jar.cookiesForUrl(url);
+    QCOMPARE(cookies.count(), 2);
+    foreach (const QNetworkCookie &cookie, cookies) {
+        if (cookie.name() == "session") {
+            QCOMPARE(cookie.value(), QByteArray("2"));
+        }
+    }
+}
+
+static QVariantMap captchaParameters(const QUrl &captchaUrl)
+{
+    QVariantMap parameters;
+    parameters[SSOUI_KEY_QUERYPASSWORD] = true;
+    parameters[SSOUI_KEY_CAPTCHAURL] = captchaUrl.toString();
+    return parameters;
+}
+
+static QByteArray captchaImage()
+{
+    QImage image(120, 40, QImage::Format_RGB32);
+    image.fill(Qt::gray);
+    QByteArray data;
+    QBuffer buffer(&data);
+    buffer.open(QIODevice::WriteOnly);
+    image.save(&buffer, "PNG");
+    return data;
+}
+
+static QWidget *visibleLoginDialog()
+{
+    foreach (QWidget *widget, QApplication::topLevelWidgets()) {
+        if (widget->objectName() == "LoginDialog" && widget->isVisible())
+            return widget;
+    }
+    return 0;
+}
+
+void SignOnUiTest::testCaptchaFailures()
+{
+    /* None of the servers below delivers the picture: keep the test short */
+    qputenv("SSOUI_CAPTCHA_TIMEOUT", "200");
+
+    /* A server which always fails: the download is attempted three times */
+    FakeHttpServer server;
+    Request *request = Request::newRequest(m_dbusConnection,
+        m_dbusMessage, captchaParameters(server.url("/missing.png")), this);
+    request->start();
+    QWidget *dialog = visibleLoginDialog();
+    QVERIFY(dialog != 0);
+    QLabel *captcha = dialog->findChild<QLabel*>("CaptchaImage");
+    QVERIFY(captcha != 0);
+    QTRY_VERIFY(captcha->text().contains("The picture could not be loaded"));
+    QCOMPARE(server.requestCount(), 3);
+    delete request;
+
+    /* A redirect loop: redirections are not counted as attempts, but after
+     * the first five each reply makes the attempt fail */
+    FakeHttpServer loopServer;
+    loopServer.setRedirect("/loop.png", loopServer.url("/loop.png").toString());
+    request = Request::newRequest(m_dbusConnection,
+        m_dbusMessage, captchaParameters(loopServer.url("/loop.png")), this);
+    request->start();
+    dialog = visibleLoginDialog();
+    QVERIFY(dialog != 0);
+    captcha = dialog->findChild<QLabel*>("CaptchaImage");
+    QTRY_VERIFY(captcha->text().contains("The picture could not be loaded"));
+    QCOMPARE(loopServer.requestCount(), 8);
+    delete request;
+
+    /* A server which is too slow: each attempt is aborted on timeout */
+    FakeHttpServer slowServer;
+    slowServer.setDelay(5000);
+    slowServer.setReply("/captcha.png", captchaImage(),
+                        "Content-Type: image/png\r\n");
+    request = Request::newRequest(m_dbusConnection,
+        m_dbusMessage, captchaParameters(slowServer.url("/captcha.png")), this);
+    request->start();
+    dialog = visibleLoginDialog();
+    QVERIFY(dialog != 0);
+    captcha = dialog->findChild<QLabel*>("CaptchaImage");
+    QTRY_VERIFY(captcha->text().contains("The picture could not be loaded"));
+    QCOMPARE(slowServer.requestCount(), 3);
+    delete request;
+
+    qunsetenv("SSOUI_CAPTCHA_TIMEOUT");
+}
+
+void SignOnUiTest::testCaptchaSlowServer()
+{
+    const int delay = 1000;
+    FakeHttpServer server;
+    server.setDelay(delay);
+    server.setReply("/captcha.png", captchaImage(),
+                    "Content-Type: image/png\r\n");
+
+    QElapsedTimer timer;
+    timer.start();
+    Request *request = Request::newRequest(m_dbusConnection,
+        m_dbusMessage, captchaParameters(server.url("/captcha.png")), this);
+    request->prepare();
+    request->start();
+
+    /* The dialog must not wait for the picture */
+    QWidget *dialog = visibleLoginDialog();
+    QVERIFY(dialog != 0);
+    qint64 timeToDialog = timer.elapsed();
+    QVERIFY2(timeToDialog < delay,
+             qPrintable(QString("Dialog shown after %1 ms").
+                        arg(timeToDialog)));
+    QLabel *captcha = dialog->findChild<QLabel*>("CaptchaImage");
+    QVERIFY(captcha != 0);
+    QVERIFY(captcha->pixmap() == 0 || captcha->pixmap()->isNull());
+
+    /* The picture shows up once downloaded, and was requested only once */
+    QTRY_VERIFY(captcha->pixmap() != 0 && !captcha->pixmap()->isNull());
+    QCOMPARE(server.requestCount(), 1);
+    delete request;
+}
+
+void SignOnUiTest::testCaptchaPrefetch()
+{
+    FakeHttpServer server;
+    server.setReply("/captcha.png", captchaImage(),
+                    "Content-Type: image/png\r\n");
+
+    /* While the request is queued, the picture is downloaded and decoded */
+    Request *request = Request::newRequest(m_dbusConnection,
+        m_dbusMessage, captchaParameters(server.url("/captcha.png")), this);
+    request->prepare();
+    QTRY_COMPARE(server.requestCount(), 1);
+    QTest::qWait(200);
+    QCOMPARE(visibleLoginDialog(), (QWidget*)0);
+
+    /* The dialog shows it right away, without downloading it again */
+    request->start();
+    QWidget *dialog = visibleLoginDialog();
+    QVERIFY(dialog != 0);
+    QLabel *captcha = dialog->findChild<QLabel*>("CaptchaImage");
+    QVERIFY(captcha != 0);
+    QVERIFY(captcha->pixmap() != 0);
+    QCOMPARE(captcha->pixmap()->size(), QSize(120, 40));
+    QCOMPARE(server.requestCount(), 1);
+    delete request;
+}
+
+void SignOnUiTest::testDialogReuse()
+{
+    QVariantMap parameters;
+    parameters[SSOUI_KEY_USERNAME] = "john";
+    parameters[SSOUI_KEY_QUERYPASSWORD] = true;
+
+    Request *request = Request::newRequest(m_dbusConnection,
+        m_dbusMessage, parameters, this);
+    request->start();
+    QPointer<QWidget> dialog = visibleLoginDialog();
+    QVERIFY(dialog != 0);
+    QLineEdit *username = dialog->findChild<QLineEdit*>("UsernameField");
+    QLineEdit *password = dialog->findChild<QLineEdit*>("PasswordField");
+    QVERIFY(username != 0);
+    QVERIFY(password != 0);
+    QCOMPARE(username->text(), QString("john"));
+    QCOMPARE(username->isEnabled(), false);
+    password->setText("secret");
+    delete request;
+
+    /* The idle dialog is kept, without any trace of the credentials */
+    QVERIFY(dialog != 0);
+    QCOMPARE(dialog->isVisible(), false);
+    foreach (QLineEdit *lineEdit, dialog->findChildren<QLineEdit*>()) {
+        QCOMPARE(lineEdit->text(), QString());
+        QCOMPARE(lineEdit->isEnabled(), true);
+    }
+
+    /* A request showing the same fields gets it back */
+    parameters.remove(SSOUI_KEY_USERNAME);
+    parameters[SSOUI_KEY_QUERYUSERNAME] = true;
+    request = Request::newRequest(m_dbusConnection,
+        m_dbusMessage, parameters, this);
+    request->start();
+    QCOMPARE(visibleLoginDialog(), dialog.data());
+    QCOMPARE(username->text(), QString());
+    QCOMPARE(username->isEnabled(), true);
+    QCOMPARE(password->text(), QString());
+    delete request;
+}
+
+void SignOnUiTest::testDialogReuseBenchmark_data()
+{
+    QTest::addColumn<bool>("reuse");
+
+    QTest::newRow("new dialog") << false;
+    QTest::newRow("pooled dialog") << true;
+}
+
+void SignOnUiTest::testDialogReuseBenchmark()
+{
+    QFETCH(bool, reuse);
+
+    QVariantMap parameters;
+    parameters[SSOUI_KEY_MESSAGE] = "Enter your credentials";
+    parameters[SSOUI_KEY_QUERYUSERNAME] = true;
+    parameters[SSOUI_KEY_QUERYPASSWORD] = true;
+
+    DialogPool::instance()->clear();
+    QBENCHMARK {
+        Request *request = Request::newRequest(m_dbusConnection,
+            m_dbusMessage, parameters, this);
+        request->start();
+        delete request;
+        if (!reuse) DialogPool::instance()->clear();
+    }
+}
+
 static void prepareAuthData(AuthData &authData, int identity)
 {
     QVariantMap sessionData;
@@ -36,6 +36,18 @@ private Q_SLOTS:
     void initTestCase();
     void testRequestObjects();
     void testRequestWithIndicator();
+    void testResourceFilter();
+    void testNetworkCache();
+    void testNetworkCacheWithCookies();
+    void testCookieRouting();
+    void testFinalUrlRedirect();
+    void testCookieMerge();
+    void testCaptchaFailures();
+    void testCaptchaSlowServer();
+    void testCaptchaPrefetch();
+    void testDialogReuse();
+    void testDialogReuseBenchmark_data();
+    void testDialogReuseBenchmark();
 
     void testReauthenticator();
     void testIndicatorService();
@@ -0,0 +1,178 @@
+/*
+ * This file is part of signon-ui
+ *
+ * Copyright (C) 2014 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "debug.h"
+#include "load-retry-policy.h"
+
+#include <QDebug>
+#include <QObject>
+#include <QSettings>
+#include <QSignalSpy>
+#include <QTemporaryDir>
+#include <QTest>
+
+using namespace SignOnUi;
+
+class LoadRetryPolicyTest: public QObject
+{
+    Q_OBJECT
+
+public:
+    LoadRetryPolicyTest() {};
+
+private Q_SLOTS:
+    void initTestCase();
+    void testRetryThenSucceed();
+    void testBackoffThenGiveUp();
+    void testNoRetryOnSslErrors();
+    void testNewLoadCancelsRetry();
+    void testLoadTimeout();
+
+private:
+    QTemporaryDir m_configDir;
+};
+
+static const QString fastHost = QStringLiteral("fast.example.com");
+static const QString slowHost = QStringLiteral("slow.example.com");
+
+void LoadRetryPolicyTest::initTestCase()
+{
+    QVERIFY(m_configDir.isValid());
+    QSettings::setPath(QSettings::NativeFormat, QSettings::UserScope,
+                       m_configDir.path());
+
+    QSettings fast("signon-ui/webkit-options.d/" + fastHost, QString());
+    fast.setValue("LoadRetryDelay", 50);
+    fast.setValue("LoadRetries", 2);
+
+    QSettings slow("signon-ui/webkit-options.d/" + slowHost, QString());
+    slow.setValue("LoadTimeout", 100);
+    slow.setValue("LoadRetries", 0);
+}
+
+void LoadRetryPolicyTest::testRetryThenSucceed()
+{
+    LoadRetryPolicy policy;
+    QSignalSpy retry(&policy, SIGNAL(retry()));
+    QSignalSpy failed(&policy, SIGNAL(failed()));
+    LoadRetryPolicy::Statistics before = LoadRetryPolicy::statistics();
+
+    policy.loadStarted(fastHost);
+    policy.loadFailed(LoadRetryPolicy::ConnectionError);
+    QCOMPARE(retry.count(), 0);
+    QVERIFY(retry.wait(200));
+    QCOMPARE(policy.retryCount(), 1);
+
+    policy.loadStarted(fastHost);
+    policy.loadSucceeded();
+    QCOMPARE(policy.retryCount(), 0);
+    QCOMPARE(failed.count(), 0);
+
+    LoadRetryPolicy::Statistics after = LoadRetryPolicy::statistics();
+    QCOMPARE(after.loads - before.loads, 1);
+    QCOMPARE(after.recoveredLoads - before.recoveredLoads, 1);
+    QCOMPARE(after.retries - before.retries, 1);
+}
+
+void LoadRetryPolicyTest::testBackoffThenGiveUp()
+{
+    LoadRetryPolicy policy;
+    QSignalSpy retry(&policy, SIGNAL(retry()));
+    QSignalSpy failed(&policy, SIGNAL(failed()));
+
+    policy.loadStarted(fastHost);
+    policy.loadFailed(LoadRetryPolicy::ConnectionError);
+    QCOMPARE(policy.retryDelay(), 50);
+    QVERIFY(retry.wait(200));
+
+    policy.loadStarted(fastHost);
+    policy.loadFailed(LoadRetryPolicy::ConnectionError);
+    QCOMPARE(policy.retryDelay(), 100);
+    QVERIFY(retry.wait(300));
+    QCOMPARE(retry.count(), 2);
+
+    /* All retries are used: the next failure must be reported at once */
+    policy.loadStarted(fastHost);
+    policy.loadFailed(LoadRetryPolicy::ConnectionError);
+    QCOMPARE(failed.count(), 1);
+    QCOMPARE(retry.count(), 2);
+}
+
+void LoadRetryPolicyTest::testNoRetryOnSslErrors()
+{
+    LoadRetryPolicy policy;
+    QSignalSpy retry(&policy, SIGNAL(retry()));
+    QSignalSpy failed(&policy, SIGNAL(failed()));
+
+    policy.loadStarted(fastHost);
+    policy.loadFailed(LoadRetryPolicy::SslError);
+    QCOMPARE(failed.count(), 1);
+
+    QTest::qWait(100);
+    QCOMPARE(retry.count(), 0);
+}
+
+void LoadRetryPolicyTest::testNewLoadCancelsRetry()
+{
+    LoadRetryPolicy policy;
+    QSignalSpy retry(&policy, SIGNAL(retry()));
+    QSignalSpy failed(&policy, SIGNAL(failed()));
+
+    /* A navigation interrupted by another one is not a failure */
+    policy.loadStarted(fastHost);
+    policy.loadFailed(LoadRetryPolicy::CanceledError);
+    QTest::qWait(20);
+    policy.loadStarted(fastHost);
+    policy.loadSucceeded();
+
+    QTest::qWait(100);
+    QCOMPARE(retry.count(), 0);
+    QCOMPARE(failed.count(), 0);
+}
+
+void LoadRetryPolicyTest::testLoadTimeout()
+{
+    LoadRetryPolicy policy;
+    QSignalSpy retry(&policy, SIGNAL(retry()));
+    QSignalSpy failed(&policy, SIGNAL(failed()));
+    QSignalSpy abortLoad(&policy, SIGNAL(abortLoad()));
+
+    policy.loadStarted(slowHost);
+    QTest::qWait(50);
+    QCOMPARE(failed.count(), 0);
+    QVERIFY(failed.wait(200));
+    QCOMPARE(abortLoad.count(), 1);
+    QCOMPARE(retry.count(), 0);
+
+    /* The end of the aborted load must not be reported again */
+    QVERIFY(policy.loadAbandoned());
+    policy.loadFailed(LoadRetryPolicy::CanceledError);
+    policy.loadSucceeded();
+    QTest::qWait(100);
+    QCOMPARE(failed.count(), 1);
+    QCOMPARE(retry.count(), 0);
+
+    policy.loadStarted(slowHost);
+    QVERIFY(!policy.loadAbandoned());
+    policy.cancel();
+}
+
+QTEST_MAIN(LoadRetryPolicyTest);
+#include "tst_load_retry_policy.moc"
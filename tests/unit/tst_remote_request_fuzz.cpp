@@ -0,0 +1,392 @@
+/*
+ * This file is part of signon-ui
+ *
+ * Copyright (C) 2014 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "debug.h"
+#include "remote-request-interface.h"
+#include "unix-socket-channel.h"
+
+#include <QBuffer>
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QObject>
+#include <QStringList>
+#include <QTest>
+#include <SignOn/uisessiondata_priv.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace SignOnUi;
+
+/* How many frames the fuzz tests send; set SSOUI_FUZZ_FRAMES to a few
+ * millions for a long run, and SSOUI_FUZZ_SEED to replay a failure. */
+static const int defaultFrameCount = 50000;
+static const int batchSize = 1000;
+static const int benchmarkFrameCount = 10000;
+
+/* Every frame is different, but it can be rebuilt from its index alone, so
+ * that the receiver can check it without keeping the sent frames around */
+static QVariantMap frameParameters(int index)
+{
+    QVariantMap parameters;
+    parameters[SSOUI_KEY_OPENURL] =
+        QString("https://example.com/authorize?state=%1").arg(index);
+    parameters[SSOUI_KEY_IDENTITY] = uint(index % 5);
+    if (index % 3 == 0) {
+        parameters["X-Blob"] = QByteArray(index % 301, char(index));
+    }
+    if (index % 5 == 0) {
+        QVariantMap clientData;
+        clientData[SSOUI_KEY_WINDOWID] = uint(index);
+        clientData["X-Cookies"] =
+            QStringList() << "a" << QString::number(index);
+        parameters[SSOUI_KEY_CLIENT_DATA] = clientData;
+    }
+    if (index % 11 == 0) {
+        parameters["X-Large"] = qint64(index) << 33;
+    }
+    return parameters;
+}
+
+static bool isCanceled(int index)
+{
+    return index % 7 == 0;
+}
+
+/* Mostly tiny fragments, which split headers and payloads everywhere, with
+ * some larger ones in between */
+static int randomFragmentSize()
+{
+    switch (qrand() % 4) {
+    case 0: return 1;
+    case 1: return 1 + qrand() % 16;
+    case 2: return 1 + qrand() % 512;
+    default: return 1 + qrand() % (64 * 1024);
+    }
+}
+
+/* What a Qt application might print before the welcome message, including
+ * some partial matches of it */
+static QByteArray randomNoise()
+{
+    static const char *partialMatches[] = {
+        "S", "Ss", "Sso", "SsoU", "SsoSsoU"
+    };
+    QByteArray noise;
+    int length = qrand() % 2048;
+    while (noise.length() < length) {
+        if (qrand() % 32 == 0) {
+            noise.append(partialMatches[qrand() % 5]);
+            noise.append('\n');
+        } else {
+            char c = 32 + qrand() % 95;
+            noise.append(c == 'S' ? '\n' : c);
+        }
+    }
+    return noise;
+}
+
+/* Makes the data written to it available to the reader one fragment at a
+ * time, each of them announced by readyRead() as a socket would do. */
+class FragmentingDevice: public QIODevice
+{
+    Q_OBJECT
+
+public:
+    FragmentingDevice(): QIODevice(), m_pendingPos(0), m_availablePos(0) {
+        open(QIODevice::ReadWrite);
+    }
+
+    bool isSequential() const { return true; }
+    qint64 bytesAvailable() const {
+        return m_available.size() - m_availablePos +
+            QIODevice::bytesAvailable();
+    }
+    int pendingBytes() const { return m_pending.size() - m_pendingPos; }
+
+    void deliverFragment() {
+        int size = qMin(randomFragmentSize(), pendingBytes());
+        if (m_availablePos > 0) {
+            m_available.remove(0, m_availablePos);
+            m_availablePos = 0;
+        }
+        m_available.append(m_pending.constData() + m_pendingPos, size);
+        m_pendingPos += size;
+        if (m_pendingPos == m_pending.size()) {
+            m_pending.clear();
+            m_pendingPos = 0;
+        }
+        Q_EMIT readyRead();
+    }
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) {
+        qint64 size = qMin(maxSize, qint64(m_available.size() - m_availablePos));
+        memcpy(data, m_available.constData() + m_availablePos, size);
+        m_availablePos += size;
+        return size;
+    }
+
+    qint64 writeData(const char *data, qint64 size) {
+        m_pending.append(data, size);
+        return size;
+    }
+
+private:
+    QByteArray m_pending;
+    int m_pendingPos;
+    QByteArray m_available;
+    int m_availablePos;
+};
+
+/* Checks the frames as they are received */
+class FrameChecker: public QObject
+{
+    Q_OBJECT
+
+public:
+    FrameChecker(): m_started(0), m_canceled(0), m_errors(0) {}
+
+    int started() const { return m_started; }
+    int canceled() const { return m_canceled; }
+    int errors() const { return m_errors; }
+
+public Q_SLOTS:
+    void onStarted(int requestId, const QVariantMap &parameters) {
+        /* The client assigns the ids sequentially, starting from 1 */
+        int index = requestId - 1;
+        if (index != m_started || parameters != frameParameters(index)) {
+            if (m_errors++ == 0) {
+                qWarning() << "Frame" << m_started << "received as" <<
+                    requestId << parameters;
+            }
+        }
+        m_started++;
+    }
+
+    void onCanceled(int requestId) {
+        int index = requestId - 1;
+        if (index != 7 * m_canceled || index >= m_started) {
+            if (m_errors++ == 0) {
+                qWarning() << "Unexpected cancellation of" << requestId;
+            }
+        }
+        m_canceled++;
+    }
+
+private:
+    int m_started;
+    int m_canceled;
+    int m_errors;
+};
+
+class RemoteRequestFuzzTest: public QObject
+{
+    Q_OBJECT
+
+public:
+    RemoteRequestFuzzTest():
+        m_frameCount(defaultFrameCount),
+        m_client(0),
+        m_checker(0) {};
+
+private Q_SLOTS:
+    void initTestCase();
+    void init();
+    void cleanup();
+    void testFragmentedBuffer();
+    void testFragmentedSocket();
+    void benchmarkDecode();
+
+private:
+    QByteArray nextBatch(int first, int count);
+    void connectChecker(RemoteRequestServer *server);
+    void reportRate(const QElapsedTimer &timer);
+    int expectedCanceled() const;
+
+private:
+    int m_frameCount;
+    RemoteRequestClient *m_client;
+    QBuffer m_clientInput;
+    QBuffer m_clientOutput;
+    FrameChecker *m_checker;
+};
+
+void RemoteRequestFuzzTest::initTestCase()
+{
+    bool ok;
+    int frames = qgetenv("SSOUI_FUZZ_FRAMES").toInt(&ok);
+    if (ok && frames > 0) m_frameCount = frames;
+
+    uint seed = qgetenv("SSOUI_FUZZ_SEED").toUInt(&ok);
+    if (!ok) seed = QDateTime::currentDateTime().toTime_t();
+    qDebug() << "Fuzzing" << m_frameCount << "frames, seed" << seed;
+    qsrand(seed);
+}
+
+void RemoteRequestFuzzTest::init()
+{
+    m_clientInput.open(QIODevice::ReadOnly);
+    m_clientOutput.open(QIODevice::WriteOnly);
+    m_client = new RemoteRequestClient;
+    /* This writes the welcome message */
+    m_client->setChannels(&m_clientInput, &m_clientOutput);
+    m_checker = new FrameChecker;
+}
+
+void RemoteRequestFuzzTest::cleanup()
+{
+    delete m_client;
+    m_client = 0;
+    delete m_checker;
+    m_checker = 0;
+    m_clientInput.close();
+    m_clientOutput.close();
+    m_clientOutput.setData(QByteArray());
+}
+
+QByteArray RemoteRequestFuzzTest::nextBatch(int first, int count)
+{
+    for (int i = first; i < first + count; i++) {
+        int requestId = m_client->start(frameParameters(i));
+        if (isCanceled(i)) m_client->cancel(requestId);
+    }
+
+    QByteArray data = m_clientOutput.data();
+    m_clientOutput.buffer().clear();
+    m_clientOutput.seek(0);
+    return data;
+}
+
+void RemoteRequestFuzzTest::connectChecker(RemoteRequestServer *server)
+{
+    QObject::connect(server, SIGNAL(started(int,const QVariantMap&)),
+                     m_checker, SLOT(onStarted(int,const QVariantMap&)));
+    QObject::connect(server, SIGNAL(canceled(int)),
+                     m_checker, SLOT(onCanceled(int)));
+}
+
+void RemoteRequestFuzzTest::reportRate(const QElapsedTimer &timer)
+{
+    qint64 elapsed = qMax(timer.elapsed(), qint64(1));
+    qDebug() << m_checker->started() << "frames in" << elapsed << "ms," <<
+        m_checker->started() * 1000 / elapsed << "frames/s";
+}
+
+int RemoteRequestFuzzTest::expectedCanceled() const
+{
+    return (m_frameCount + 6) / 7;
+}
+
+void RemoteRequestFuzzTest::testFragmentedBuffer()
+{
+    FragmentingDevice serverInput;
+    QBuffer serverOutput;
+    serverOutput.open(QIODevice::WriteOnly);
+    RemoteRequestServer server;
+    connectChecker(&server);
+    server.setChannels(&serverInput, &serverOutput);
+
+    QElapsedTimer timer;
+    timer.start();
+    serverInput.write(randomNoise());
+    for (int first = 0; first < m_frameCount; first += batchSize) {
+        serverInput.write(nextBatch(first, qMin(batchSize,
+                                                m_frameCount - first)));
+        while (serverInput.pendingBytes() > 0) {
+            serverInput.deliverFragment();
+        }
+        /* Every complete frame must have been handled by now */
+        QCOMPARE(m_checker->errors(), 0);
+        QCOMPARE(m_checker->started(), qMin(first + batchSize, m_frameCount));
+        QCOMPARE(serverInput.bytesAvailable(), qint64(0));
+    }
+    reportRate(timer);
+
+    QCOMPARE(m_checker->started(), m_frameCount);
+    QCOMPARE(m_checker->canceled(), expectedCanceled());
+}
+
+void RemoteRequestFuzzTest::testFragmentedSocket()
+{
+    int fds[2];
+    QCOMPARE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    int writeFd = fds[0];
+    fcntl(writeFd, F_SETFL, fcntl(writeFd, F_GETFL) | O_NONBLOCK);
+    UnixSocketChannel serverChannel;
+    QVERIFY(serverChannel.setSocketDescriptor(fds[1]));
+    RemoteRequestServer server;
+    connectChecker(&server);
+    server.setChannels(&serverChannel, &serverChannel);
+
+    QElapsedTimer timer;
+    timer.start();
+    QByteArray data = randomNoise();
+    for (int first = 0; first < m_frameCount; first += batchSize) {
+        data += nextBatch(first, qMin(batchSize, m_frameCount - first));
+        int written = 0;
+        while (written < data.size()) {
+            int size = qMin(randomFragmentSize(), data.size() - written);
+            ssize_t ret = ::write(writeFd, data.constData() + written, size);
+            if (ret > 0) {
+                written += ret;
+            } else {
+                QVERIFY(errno == EAGAIN || errno == EINTR);
+            }
+            /* Let the server read what has arrived so far */
+            QCoreApplication::processEvents();
+        }
+        data.clear();
+        QCOMPARE(m_checker->errors(), 0);
+    }
+    QTRY_COMPARE_WITH_TIMEOUT(m_checker->started(), m_frameCount, 10000);
+    reportRate(timer);
+
+    QCOMPARE(m_checker->errors(), 0);
+    QCOMPARE(m_checker->canceled(), expectedCanceled());
+    QCOMPARE(serverChannel.bytesAvailable(), qint64(0));
+    close(writeFd);
+}
+
+void RemoteRequestFuzzTest::benchmarkDecode()
+{
+    QByteArray data = nextBatch(0, benchmarkFrameCount);
+
+    QBENCHMARK {
+        delete m_checker;
+        m_checker = new FrameChecker;
+        QBuffer serverInput(&data);
+        serverInput.open(QIODevice::ReadOnly);
+        QBuffer serverOutput;
+        serverOutput.open(QIODevice::WriteOnly);
+        RemoteRequestServer server;
+        connectChecker(&server);
+        /* The whole stream is parsed right away */
+        server.setChannels(&serverInput, &serverOutput);
+        QCOMPARE(m_checker->started(), benchmarkFrameCount);
+    }
+    QCOMPARE(m_checker->errors(), 0);
+}
+
+QTEST_MAIN(RemoteRequestFuzzTest);
+#include "tst_remote_request_fuzz.moc"
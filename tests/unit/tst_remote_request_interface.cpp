@@ -0,0 +1,469 @@
+/*
+ * This file is part of signon-ui
+ *
+ * Copyright (C) 2014 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "debug.h"
+#include "remote-request-interface.h"
+#include "unix-socket-channel.h"
+
+#include <QDebug>
+#include <QLocalSocket>
+#include <QObject>
+#include <QSignalSpy>
+#include <QStringList>
+#include <QTest>
+#include <SignOn/uisessiondata_priv.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace SignOnUi;
+
+class RemoteRequestInterfaceTest: public QObject
+{
+    Q_OBJECT
+
+public:
+    RemoteRequestInterfaceTest():
+        m_clientSocket(0),
+        m_serverSocket(0) {};
+
+private Q_SLOTS:
+    void init();
+    void cleanup();
+    void testRoundTrip();
+    void testNoiseBeforeWelcome();
+    void testSplitWelcome();
+    void testLargeMessage();
+    void testConcurrentRequests();
+    void testProgressEvents();
+    void testInvalidFrame();
+    void testSharedMemoryPayload();
+    void benchmarkHandshake();
+    void benchmarkThroughput();
+    void benchmarkPayloadSize_data();
+    void benchmarkPayloadSize();
+
+private:
+    QVariantMap sampleParameters() const;
+    bool waitCount(QSignalSpy &spy, int count);
+
+private:
+    QLocalSocket *m_clientSocket;
+    QLocalSocket *m_serverSocket;
+};
+
+void RemoteRequestInterfaceTest::init()
+{
+    int fds[2];
+    QCOMPARE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+    m_clientSocket = new QLocalSocket;
+    QVERIFY(m_clientSocket->setSocketDescriptor(fds[0]));
+    m_serverSocket = new QLocalSocket;
+    QVERIFY(m_serverSocket->setSocketDescriptor(fds[1]));
+}
+
+void RemoteRequestInterfaceTest::cleanup()
+{
+    delete m_clientSocket;
+    m_clientSocket = 0;
+    delete m_serverSocket;
+    m_serverSocket = 0;
+}
+
+QVariantMap RemoteRequestInterfaceTest::sampleParameters() const
+{
+    QVariantMap clientData;
+    clientData[SSOUI_KEY_WINDOWID] = uint(0x4000007);
+    clientData[SSOUI_KEY_EMBEDDED] = true;
+    clientData["X-PageComponent"] = "/usr/share/signon-ui/Page.qml";
+    clientData["Cookies"] = QByteArray("a=1;\0b=2", 8);
+
+    QVariantMap parameters;
+    parameters[SSOUI_KEY_OPENURL] = "https://example.com/authorize?client=1";
+    parameters[SSOUI_KEY_FINALURL] = "https://example.com/done";
+    parameters[SSOUI_KEY_TITLE] = QString::fromUtf8("Log in to Exämple");
+    parameters[SSOUI_KEY_IDENTITY] = uint(42);
+    parameters[SSOUI_KEY_CLIENT_DATA] = clientData;
+    parameters["X-Timestamp"] = qint64(1) << 40;
+    parameters["X-Retries"] = -3;
+    parameters["X-Scopes"] = QStringList() << "email" << "profile";
+    parameters["X-Nothing"] = QVariant();
+    return parameters;
+}
+
+bool RemoteRequestInterfaceTest::waitCount(QSignalSpy &spy, int count)
+{
+    while (spy.count() < count) {
+        if (!spy.wait(2000)) return false;
+    }
+    return spy.count() == count;
+}
+
+void RemoteRequestInterfaceTest::testRoundTrip()
+{
+    RemoteRequestClient client;
+    RemoteRequestServer server;
+    QSignalSpy started(&server, SIGNAL(started(int,const QVariantMap&)));
+    QSignalSpy serverCanceled(&server, SIGNAL(canceled(int)));
+    QSignalSpy result(&client, SIGNAL(result(int,const QVariantMap&)));
+    QSignalSpy clientCanceled(&client, SIGNAL(canceled(int)));
+
+    client.setChannels(m_clientSocket, m_clientSocket);
+    server.setChannels(m_serverSocket, m_serverSocket);
+
+    QVariantMap parameters = sampleParameters();
+    int requestId = client.start(parameters);
+    QVERIFY(requestId != 0);
+    QVERIFY(waitCount(started, 1));
+    QCOMPARE(started.at(0).at(0).toInt(), requestId);
+    QCOMPARE(started.at(0).at(1).toMap(), parameters);
+
+    QVariantMap reply;
+    reply[SSOUI_KEY_URLRESPONSE] = "https://example.com/done?code=abc";
+    server.setResult(requestId, reply);
+    QVERIFY(waitCount(result, 1));
+    QCOMPARE(result.at(0).at(0).toInt(), requestId);
+    QCOMPARE(result.at(0).at(1).toMap(), reply);
+    QCOMPARE(client.pendingRequests(), 0);
+
+    requestId = client.start(QVariantMap());
+    client.cancel(requestId);
+    QVERIFY(waitCount(serverCanceled, 1));
+    QCOMPARE(serverCanceled.at(0).at(0).toInt(), requestId);
+    server.setCanceled(requestId);
+    QVERIFY(waitCount(clientCanceled, 1));
+    QCOMPARE(clientCanceled.at(0).at(0).toInt(), requestId);
+
+    /* An empty map is sent without payload */
+    QCOMPARE(started.at(1).at(1).toMap(), QVariantMap());
+}
+
+void RemoteRequestInterfaceTest::testNoiseBeforeWelcome()
+{
+    RemoteRequestClient client;
+    RemoteRequestServer server;
+    QSignalSpy started(&server, SIGNAL(started(int,const QVariantMap&)));
+
+    /* Like the output of a Qt application starting up */
+    m_clientSocket->write("QML debugging is enabled. Only use this in a "
+                          "safe environment.\nSsoU\nSsoui\n");
+    client.setChannels(m_clientSocket, m_clientSocket);
+    server.setChannels(m_serverSocket, m_serverSocket);
+
+    client.start(sampleParameters());
+    QVERIFY(waitCount(started, 1));
+    QCOMPARE(started.at(0).at(1).toMap(), sampleParameters());
+}
+
+void RemoteRequestInterfaceTest::testSplitWelcome()
+{
+    RemoteRequestServer server;
+    QSignalSpy started(&server, SIGNAL(started(int,const QVariantMap&)));
+    server.setChannels(m_serverSocket, m_serverSocket);
+
+    /* The welcome message arrives in pieces, after a partial match */
+    m_clientSocket->write("noise SsoSs");
+    m_clientSocket->flush();
+    QTest::qWait(50);
+    m_clientSocket->write("oU");
+    m_clientSocket->flush();
+    QTest::qWait(50);
+    m_clientSocket->write("i");
+    m_clientSocket->write(QByteArray("\x03\x02\x00\x00\x00\x00\x00\x01"
+                                     "\x00\x00\x00\x00", 12));
+    m_clientSocket->flush();
+
+    QSignalSpy canceled(&server, SIGNAL(canceled(int)));
+    QVERIFY(canceled.wait(1000));
+    QCOMPARE(started.count(), 0);
+}
+
+void RemoteRequestInterfaceTest::testLargeMessage()
+{
+    RemoteRequestClient client;
+    RemoteRequestServer server;
+    QSignalSpy started(&server, SIGNAL(started(int,const QVariantMap&)));
+
+    client.setChannels(m_clientSocket, m_clientSocket);
+    server.setChannels(m_serverSocket, m_serverSocket);
+
+    /* Larger than the socket buffer, so it arrives in several reads */
+    QVariantMap parameters = sampleParameters();
+    parameters["X-Blob"] = QByteArray(4 * 1024 * 1024, 'x');
+    client.start(parameters);
+    client.start(sampleParameters());
+    QVERIFY(waitCount(started, 2));
+    QCOMPARE(started.at(0).at(1).toMap(), parameters);
+    QCOMPARE(started.at(1).at(1).toMap(), sampleParameters());
+}
+
+void RemoteRequestInterfaceTest::testConcurrentRequests()
+{
+    RemoteRequestClient client;
+    RemoteRequestServer server;
+    QSignalSpy started(&server, SIGNAL(started(int,const QVariantMap&)));
+    QSignalSpy result(&client, SIGNAL(result(int,const QVariantMap&)));
+
+    client.setChannels(m_clientSocket, m_clientSocket);
+    server.setChannels(m_serverSocket, m_serverSocket);
+
+    QList<int> requestIds;
+    for (int i = 0; i < 3; i++) {
+        QVariantMap parameters;
+        parameters[SSOUI_KEY_OPENURL] = QString("https://example.com/%1").arg(i);
+        requestIds.append(client.start(parameters));
+    }
+    QCOMPARE(client.pendingRequests(), 3);
+    QVERIFY(waitCount(started, 3));
+
+    /* Reply in reverse order; each result must reach the right request */
+    for (int i = 2; i >= 0; i--) {
+        int requestId = started.at(i).at(0).toInt();
+        QVariantMap reply;
+        reply[SSOUI_KEY_URLRESPONSE] =
+            started.at(i).at(1).toMap().value(SSOUI_KEY_OPENURL);
+        server.setResult(requestId, reply);
+    }
+    QVERIFY(waitCount(result, 3));
+    for (int i = 0; i < 3; i++) {
+        int index = requestIds.indexOf(result.at(i).at(0).toInt());
+        QCOMPARE(index, 2 - i);
+        QCOMPARE(result.at(i).at(1).toMap().value(SSOUI_KEY_URLRESPONSE).toString(),
+                 QString("https://example.com/%1").arg(index));
+    }
+    QCOMPARE(client.pendingRequests(), 0);
+
+    /* A late reply for a request which already completed is dropped */
+    server.setResult(requestIds[0], QVariantMap());
+    QVERIFY(!result.wait(200));
+    QCOMPARE(result.count(), 3);
+}
+
+void RemoteRequestInterfaceTest::testProgressEvents()
+{
+    RemoteRequestClient client;
+    RemoteRequestServer server;
+    QSignalSpy started(&server, SIGNAL(started(int,const QVariantMap&)));
+    QSignalSpy loadStarted(&client, SIGNAL(loadStarted(int)));
+    QSignalSpy loadProgress(&client, SIGNAL(loadProgress(int,int)));
+    QSignalSpy urlChanged(&client, SIGNAL(urlChanged(int,const QUrl&)));
+    QSignalSpy loadFinished(&client, SIGNAL(loadFinished(int,bool)));
+    QSignalSpy memoryUsage(&client, SIGNAL(memoryUsage(qint64)));
+    QSignalSpy result(&client, SIGNAL(result(int,const QVariantMap&)));
+
+    client.setChannels(m_clientSocket, m_clientSocket);
+    server.setChannels(m_serverSocket, m_serverSocket);
+
+    int requestId = client.start(sampleParameters());
+    QVERIFY(waitCount(started, 1));
+
+    server.reportLoadStarted(requestId);
+    for (int progress = 10; progress <= 100; progress += 10) {
+        server.reportLoadProgress(requestId, progress);
+    }
+    server.reportUrlChanged(requestId, QUrl("https://example.com/a"));
+    server.reportUrlChanged(requestId, QUrl("https://example.com/b"));
+    server.reportLoadFinished(requestId, true);
+    server.reportMemoryUsage(12345);
+
+    /* Consecutive updates are merged */
+    QVERIFY(waitCount(memoryUsage, 1));
+    QCOMPARE(loadStarted.count(), 1);
+    QCOMPARE(loadProgress.count(), 1);
+    QCOMPARE(loadProgress.at(0).at(0).toInt(), requestId);
+    QCOMPARE(loadProgress.at(0).at(1).toInt(), 100);
+    QCOMPARE(urlChanged.count(), 1);
+    QCOMPARE(urlChanged.at(0).at(1).toUrl(), QUrl("https://example.com/b"));
+    QCOMPARE(loadFinished.count(), 1);
+    QCOMPARE(loadFinished.at(0).at(1).toBool(), true);
+    QCOMPARE(memoryUsage.at(0).at(0).toLongLong(), qint64(12345));
+
+    /* Pending events are sent before the result */
+    server.reportLoadProgress(requestId, 50);
+    server.setResult(requestId, QVariantMap());
+    QVERIFY(waitCount(result, 1));
+    QCOMPARE(loadProgress.count(), 2);
+
+    /* Events about completed requests are dropped */
+    server.reportLoadStarted(requestId);
+    server.reportMemoryUsage(1);
+    QVERIFY(waitCount(memoryUsage, 2));
+    QCOMPARE(loadStarted.count(), 1);
+}
+
+void RemoteRequestInterfaceTest::testInvalidFrame()
+{
+    RemoteRequestServer server;
+    QSignalSpy started(&server, SIGNAL(started(int,const QVariantMap&)));
+    server.setChannels(m_serverSocket, m_serverSocket);
+
+    /* A frame from a protocol version we don't know */
+    m_clientSocket->write("SsoUi");
+    m_clientSocket->write(QByteArray("\x01\x01\x00\x00\x00\x00\x00\x00", 8));
+    m_clientSocket->write(QByteArray("\x03\x01\x00\x00\x00\x00\x00\x01"
+                                     "\x00\x00\x00\x00", 12));
+    m_clientSocket->flush();
+
+    QVERIFY(!started.wait(200));
+    QCOMPARE(started.count(), 0);
+}
+
+void RemoteRequestInterfaceTest::testSharedMemoryPayload()
+{
+    int fds[2];
+    QCOMPARE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    UnixSocketChannel clientChannel;
+    QVERIFY(clientChannel.setSocketDescriptor(fds[0]));
+    UnixSocketChannel serverChannel;
+    QVERIFY(serverChannel.setSocketDescriptor(fds[1]));
+
+    RemoteRequestClient client;
+    RemoteRequestServer server;
+    QSignalSpy started(&server, SIGNAL(started(int,const QVariantMap&)));
+    QSignalSpy result(&client, SIGNAL(result(int,const QVariantMap&)));
+    QSignalSpy bytesWritten(&clientChannel, SIGNAL(bytesWritten(qint64)));
+
+    client.setChannels(&clientChannel, &clientChannel);
+    server.setChannels(&serverChannel, &serverChannel);
+
+    /* Small messages stay inline, large ones travel in a memfd */
+    QVariantMap parameters = sampleParameters();
+    parameters["X-Blob"] = QByteArray(1024 * 1024, 'x');
+    client.start(sampleParameters());
+    int requestId = client.start(parameters);
+    client.start(sampleParameters());
+    QVERIFY(waitCount(started, 3));
+    QCOMPARE(started.at(0).at(1).toMap(), sampleParameters());
+    QCOMPARE(started.at(1).at(1).toMap(), parameters);
+    QCOMPARE(started.at(2).at(1).toMap(), sampleParameters());
+
+    qint64 totalWritten = 0;
+    for (int i = 0; i < bytesWritten.count(); i++) {
+        totalWritten += bytesWritten.at(i).at(0).toLongLong();
+    }
+    QVERIFY(totalWritten < 4096);
+
+    QVariantMap reply;
+    reply["X-Blob"] = QByteArray(512 * 1024, 'y');
+    server.setResult(requestId, reply);
+    QVERIFY(waitCount(result, 1));
+    QCOMPARE(result.at(0).at(1).toMap(), reply);
+}
+
+void RemoteRequestInterfaceTest::benchmarkHandshake()
+{
+    /* Startup chatter of a verbose browser process, then the first frame */
+    QByteArray noise;
+    while (noise.size() < 64 * 1024) {
+        noise += "QML debugging is enabled. Only use this in a safe "
+            "environment.\n";
+    }
+
+    QBENCHMARK {
+        cleanup();
+        init();
+        RemoteRequestClient client;
+        RemoteRequestServer server;
+        QSignalSpy started(&server, SIGNAL(started(int,const QVariantMap&)));
+
+        m_clientSocket->write(noise);
+        client.setChannels(m_clientSocket, m_clientSocket);
+        server.setChannels(m_serverSocket, m_serverSocket);
+        client.start(sampleParameters());
+        QVERIFY(waitCount(started, 1));
+    }
+}
+
+void RemoteRequestInterfaceTest::benchmarkThroughput()
+{
+    RemoteRequestClient client;
+    RemoteRequestServer server;
+    QSignalSpy started(&server, SIGNAL(started(int,const QVariantMap&)));
+
+    client.setChannels(m_clientSocket, m_clientSocket);
+    server.setChannels(m_serverSocket, m_serverSocket);
+
+    const int frames = 1000;
+    QVariantMap parameters = sampleParameters();
+    QBENCHMARK {
+        started.clear();
+        for (int i = 0; i < frames; i++) {
+            client.start(parameters);
+        }
+        QVERIFY(waitCount(started, frames));
+    }
+}
+
+void RemoteRequestInterfaceTest::benchmarkPayloadSize_data()
+{
+    QTest::addColumn<int>("size");
+    QTest::addColumn<bool>("sharedMemory");
+
+    QList<int> sizes;
+    sizes << 1024 << 64 * 1024 << 1024 * 1024 << 10 * 1024 * 1024;
+    foreach (int size, sizes) {
+        QByteArray name = QByteArray::number(size / 1024) + " KB";
+        QTest::newRow(name + ", stream") << size << false;
+        QTest::newRow(name + ", memfd") << size << true;
+    }
+}
+
+void RemoteRequestInterfaceTest::benchmarkPayloadSize()
+{
+    QFETCH(int, size);
+    QFETCH(bool, sharedMemory);
+
+    /* QLocalSocket cannot carry descriptors, so payloads are always sent
+     * inline over it */
+    int fds[2];
+    QCOMPARE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    UnixSocketChannel clientChannel;
+    UnixSocketChannel serverChannel;
+    QIODevice *clientDevice = m_clientSocket;
+    QIODevice *serverDevice = m_serverSocket;
+    if (sharedMemory) {
+        QVERIFY(clientChannel.setSocketDescriptor(fds[0]));
+        QVERIFY(serverChannel.setSocketDescriptor(fds[1]));
+        clientDevice = &clientChannel;
+        serverDevice = &serverChannel;
+    } else {
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+    RemoteRequestClient client;
+    RemoteRequestServer server;
+    QSignalSpy started(&server, SIGNAL(started(int,const QVariantMap&)));
+
+    client.setChannels(clientDevice, clientDevice);
+    server.setChannels(serverDevice, serverDevice);
+
+    QVariantMap parameters;
+    parameters["X-Blob"] = QByteArray(size, 'x');
+    QBENCHMARK {
+        started.clear();
+        client.start(parameters);
+        QVERIFY(waitCount(started, 1));
+    }
+    QCOMPARE(started.at(0).at(1).toMap(), parameters);
+}
+
+QTEST_MAIN(RemoteRequestInterfaceTest);
+#include "tst_remote_request_interface.moc"
@@ -0,0 +1,43 @@
+include(../../common-project-config.pri)
+include($${TOP_SRC_DIR}/common-vars.pri)
+
+TARGET = tst_remote_request_interface
+
+CONFIG += \
+    build_all \
+    debug \
+    link_pkgconfig \
+    qtestlib
+
+QT += \
+    core \
+    network
+
+PKGCONFIG += \
+    signon-plugins-common
+
+SOURCES += \
+    tst_remote_request_interface.cpp \
+    $$TOP_SRC_DIR/src/debug.cpp \
+    $$TOP_SRC_DIR/src/remote-request-interface.cpp \
+    $$TOP_SRC_DIR/src/unix-socket-channel.cpp
+HEADERS += \
+    $$TOP_SRC_DIR/src/debug.h \
+    $$TOP_SRC_DIR/src/remote-request-interface.h \
+    $$TOP_SRC_DIR/src/unix-socket-channel.h
+
+INCLUDEPATH += \
+    . \
+    $$TOP_SRC_DIR/src
+
+QMAKE_CXXFLAGS += \
+    -fno-exceptions \
+    -fno-rtti
+
+DEFINES += \
+    DEBUG_ENABLED \
+    UNIT_TESTS
+
+check.commands = "xvfb-run -a ./$$TARGET"
+check.depends = $$TARGET
+QMAKE_EXTRA_TARGETS += check
@@ -26,6 +26,7 @@ lessThan(QT_MAJOR_VERSION, 5) {
         libsignon-qt
 } else {
     QT += \
+        concurrent \
         webkitwidgets \
         widgets
     PKGCONFIG += \
@@ -34,36 +35,48 @@ lessThan(QT_MAJOR_VERSION, 5) {
 }
 
 SOURCES += \
+    fake-http-server.cpp \
     fake-libnotify.cpp \
     fake-libsignon.cpp \
     fake-webcredentials-interface.cpp \
     test.cpp \
     $$TOP_SRC_DIR/src/animation-label.cpp \
+    $$TOP_SRC_DIR/src/browser-network-access-manager.cpp \
     $$TOP_SRC_DIR/src/browser-request.cpp \
     $$TOP_SRC_DIR/src/cookie-jar-manager.cpp \
     $$TOP_SRC_DIR/src/debug.cpp \
+    $$TOP_SRC_DIR/src/dialog-pool.cpp \
     $$TOP_SRC_DIR/src/dialog-request.cpp \
     $$TOP_SRC_DIR/src/dialog.cpp \
     $$TOP_SRC_DIR/src/http-warning.cpp \
     $$TOP_SRC_DIR/src/i18n.cpp \
     $$TOP_SRC_DIR/src/indicator-service.cpp \
+    $$TOP_SRC_DIR/src/load-retry-policy.cpp \
     $$TOP_SRC_DIR/src/network-access-manager.cpp \
+    $$TOP_SRC_DIR/src/network-cache.cpp \
+    $$TOP_SRC_DIR/src/process-memory.cpp \
     $$TOP_SRC_DIR/src/reauthenticator.cpp \
     $$TOP_SRC_DIR/src/request.cpp \
     $$TOP_SRC_DIR/src/webcredentials_adaptor.cpp
 HEADERS += \
+    fake-http-server.h \
     fake-libnotify.h \
     fake-webcredentials-interface.h \
     test.h \
     $$TOP_SRC_DIR/src/animation-label.h \
+    $$TOP_SRC_DIR/src/browser-network-access-manager.h \
     $$TOP_SRC_DIR/src/browser-request.h \
     $$TOP_SRC_DIR/src/debug.h \
     $$TOP_SRC_DIR/src/cookie-jar-manager.h \
+    $$TOP_SRC_DIR/src/dialog-pool.h \
     $$TOP_SRC_DIR/src/dialog-request.h \
     $$TOP_SRC_DIR/src/dialog.h \
     $$TOP_SRC_DIR/src/http-warning.h \
     $$TOP_SRC_DIR/src/indicator-service.h \
+    $$TOP_SRC_DIR/src/load-retry-policy.h \
     $$TOP_SRC_DIR/src/network-access-manager.h \
+    $$TOP_SRC_DIR/src/network-cache.h \
+    $$TOP_SRC_DIR/src/process-memory.h \
     $$TOP_SRC_DIR/src/reauthenticator.h \
     $$TOP_SRC_DIR/src/request.h \
     $$TOP_SRC_DIR/src/webcredentials_adaptor.h
@@ -1,4 +1,7 @@
 TEMPLATE = subdirs
 SUBDIRS = \
     tst_inactivity_timer.pro \
+    tst_load_retry_policy.pro \
+    tst_remote_request_fuzz.pro \
+    tst_remote_request_interface.pro \
     tst_signon_ui.pro